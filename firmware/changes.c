@@ -0,0 +1,111 @@
+#include <string.h>
+#include <util/atomic.h>
+#include <util/crc16.h>
+#include "changes.h"
+#include "registers.h"
+#include "temp.h"
+#include "ee.h"
+
+uint16_t changes_generation;
+
+/* Each register's value when we last looked: itself if it is one
+   byte, otherwise its CRC-8.  A change within any one byte always
+   alters the CRC; a wider one is missed about 1 time in 256, which is
+   the price of not spending another CHANGES_REGISTERS bytes of RAM.
+   The head end reads each register again now and then regardless. */
+static uint8_t check[CHANGES_REGISTERS];
+
+/* Probe readings as they were when last counted as changed */
+static int32_t counted[PROBES];
+
+/* changed[0] is registers changed since generation base[0], and
+   changed[1] since base[1], the latest report */
+#define MAP_BYTES ((CHANGES_REGISTERS+7)/8)
+static uint8_t changed[2][MAP_BYTES];
+static uint16_t base[2];
+
+static uint8_t check_value(const struct reg *r)
+{
+  uint8_t raw[REG_RAW_MAX];
+  char buf[32];
+  uint8_t *p=raw;
+  uint8_t len,i;
+  uint8_t crc=0;
+  len=reg_read_raw(r,raw);
+  if (len==0) {
+    /* No raw form; use the string */
+    reg_read_string(r,buf,sizeof(buf));
+    p=(uint8_t *)buf;
+    len=strlen(buf);
+  }
+  if (len<=1) return len?p[0]:0;
+  for (i=0; i<len; i++) crc=_crc8_ccitt_update(crc,p[i]);
+  return crc;
+}
+
+/* Has probe n's reading moved far enough to count? */
+static uint8_t probe_moved(uint8_t n)
+{
+  int32_t t,d;
+  int16_t db;
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    t=probes[n].temp;
+  }
+  if (t==counted[n]) return 0;
+  db=ee_read_word((void *)PROBE_DEADBAND(n));
+  if (t!=BAD_TEMP && counted[n]!=BAD_TEMP && db!=PROBE_CAL_UNSET && db>0) {
+    d=t-counted[n];
+    if (d<0) d=-d;
+    if (d<(int32_t)db*100) return 0;
+  }
+  counted[n]=t;
+  return 1;
+}
+
+static void scan(void)
+{
+  const struct reg *r;
+  uint8_t c,i;
+  int8_t n;
+  for (i=0; (r=reg_number(i)); i++) {
+    if ((n=reg_probe(r))>=0) {
+      if (!probe_moved(n)) continue;
+    } else {
+      c=check_value(r);
+      if (c==check[i]) continue;
+      check[i]=c;
+    }
+    changes_generation++;
+    changed[0][i/8]|=1<<(i%8);
+    changed[1][i/8]|=1<<(i%8);
+  }
+}
+
+static void restart(void)
+{
+  base[0]=base[1]=changes_generation;
+  memset(changed,0,sizeof(changed));
+}
+
+void changes_restart(void)
+{
+  scan();
+  restart();
+}
+
+const uint8_t *changes_since(uint16_t since)
+{
+  scan();
+  if (since==base[1]) {
+    /* The last report arrived, so we won't need the one before */
+    memcpy(changed[0],changed[1],MAP_BYTES);
+    base[0]=base[1];
+  } else if (since!=base[0]) {
+    restart();
+    return NULL;
+  }
+  /* Report changed[0], and start the next report from here */
+  memset(changed[1],0,MAP_BYTES);
+  base[1]=changes_generation;
+  return changed[0];
+}
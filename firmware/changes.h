@@ -0,0 +1,31 @@
+#ifndef _changes_h
+#define _changes_h
+
+#include <stdint.h>
+#include "config.h"
+
+/* Report by exception.  Whenever we look, each register is compared
+   with what it was last time, and each one found to have changed bumps
+   the generation and is marked in two bitmaps: changed since the last
+   report, and since the one before that, so that a report that went
+   astray can be asked for again.  A probe reading only counts as
+   changed once it has moved by the probe's deadband. */
+
+/* Per-probe deadband in eeprom, int16 hundredths of a degree; unset
+   (0xffff) or not above zero means any change counts.  See
+   eeprom-layout. */
+#define PROBE_DEADBAND(n) (0x160+(n)*2)
+
+extern uint16_t changes_generation;
+
+/* Bitmap, by register number, of the registers that have changed
+   since generation since, which must be that of one of the last two
+   reports; NULL if it isn't.  Either way, this is now the latest
+   report. */
+extern const uint8_t *changes_since(uint16_t since);
+
+/* Forget earlier reports; the next must be since the current
+   generation.  Call once at boot too, once everything is running. */
+extern void changes_restart(void);
+
+#endif /* _changes_h */
@@ -1,20 +1,58 @@
 #include <stdio.h>
 #include <string.h>
 #include <avr/pgmspace.h>
+#include <util/crc16.h>
 #include "command.h"
 #include "serial.h"
 #include "registers.h"
 #include "hardware.h"
 #include "owb.h"
+#include "control.h"
+#include "settings.h"
+#include "temp.h"
+#include "profile.h"
+#include "ee.h"
+#include "frame.h"
+#include "alarm.h"
+#include "changes.h"
 
 static uint8_t selected;
 
+/* Transactions: between BEGIN and COMMIT, SETs are kept in this
+   journal rather than written.  COMMIT writes them all in one go, so
+   the control loops never run with half of a change; if a write fails,
+   the ones before it are put back.  Each entry is the register pointer
+   followed by the new value as a string. */
+static char journal[TXN_JOURNAL_SIZE];
+static uint8_t journal_len;
+static uint8_t in_txn;
+
+/* Configuration images: CFGDUMP and CFGLOAD move the whole eeprom in
+   chunks of CFG_CHUNK bytes, each sent as hex with a CRC. */
+#define CFG_CHUNK 16
+#define CFG_CHUNKS (EE_SIZE/CFG_CHUNK)
+#define CFG_IDLE 0xff
+static uint8_t cfg_next=CFG_IDLE; /* Chunk CFGLOAD expects next */
+
+/* Eeprom that CFGLOAD leaves alone, because it belongs to this
+   controller rather than its configuration */
+static const struct {
+  uint16_t start;
+  uint8_t len;
+} PROGMEM cfg_protected[]={
+  {PROFILE_STATE,12}, /* Where a running profile has got to */
+  {STATS_EEPROM,16}, /* Relay and valve statistics */
+  {SETTINGS_CRC_EEPROM,2}, /* Worked out again after loading */
+  {0x3e1,1}, /* Bus address */
+  {0x3f4,12}, /* ident and flashcnt */
+};
+
 static const char PROGMEM okcmd[]="OK %s\n";
 static const char PROGMEM noreg[]="ERR register %s does not exist\n";
 
 static uint8_t it_is(const char *command)
 {
-  char buf[8];
+  char buf[12];
   int len;
   strcpy_P(buf,command);
   len=strlen(buf);
@@ -24,31 +62,129 @@ static uint8_t it_is(const char *command)
   return 0;
 }
 
-static void select_cmd(const char *arg)
+static void select(uint8_t us)
 {
-  char buf[9];
-  reg_read_string(&ident,buf,9);
-  if (strcmp(arg,buf)==0) {
+  serial_confirm(); /* Any selection shows the line rate is working */
+  if (us) {
     RS485_XMIT_ON();
     selected=1;
     serial_transmit_abort(); /* Stop any debug output */
-    printf_P(PSTR("OK %s selected\n"),buf);
+    printf_P(PSTR("OK %s selected\n"),settings.ident);
   } else {
     selected=0;
+    in_txn=0; /* Another station's turn; drop anything staged */
+    cfg_next=CFG_IDLE;
   }
+}
+
+static void select_cmd(const char *arg)
+{
+  select(strcmp(arg,settings.ident)==0);
 }  
 
-static void read_cmd(const char *arg)
+/* Does a register name match a pattern, where * matches any number of
+   characters and ? any one? */
+static uint8_t glob_match(const char *pat, const char *name)
+{
+  for (; *pat; pat++, name++) {
+    if (*pat=='*') {
+      for (;;) {
+	if (glob_match(pat+1,name)) return 1;
+	if (!*name++) return 0;
+      }
+    }
+    if (!*name || (*pat!='?' && *pat!=*name)) return 0;
+  }
+  return !*name;
+}
+
+static uint8_t is_glob(const char *pat)
+{
+  return strchr(pat,'*') || strchr(pat,'?');
+}
+
+static void read_item(const struct reg *r, uint8_t *first)
+{
+  char name[9];
+  char buf[32];
+  reg_name(r,name);
+  reg_read_string(r,buf,32);
+  printf_P(*first?PSTR("%s=%s"):PSTR(";%s=%s"),name,buf);
+  *first=0;
+}
+
+/* READ reg gives "OK value".  With a list of names or patterns
+   separated by commas, it gives "OK name=value;name=value;..." instead,
+   all read in one go.  The reply may be much bigger than the transmit
+   buffer; printf() just waits for room. */
+static void read_cmd(char *arg)
 {
   const struct reg *r;
   char buf[32];
-  r=reg_by_name(arg);
-  if (!r) {
-    printf_P(noreg,arg);
+  char *p,*end;
+  uint8_t i,first;
+  if (!strchr(arg,',') && !is_glob(arg)) {
+    r=reg_by_name(arg);
+    if (!r) {
+      printf_P(noreg,arg);
+      return;
+    }
+    reg_read_string(r,buf,32);
+    printf_P(okcmd,buf);
     return;
   }
-  reg_read_string(r,buf,32);
-  printf_P(okcmd,buf);
+  end=arg+strlen(arg);
+  for (p=arg; *p; p++) {
+    if (*p==',') *p=0;
+  }
+  /* Check the names first, so that a mistake doesn't leave half a
+     reply */
+  for (p=arg; p<end; p+=strlen(p)+1) {
+    if (!is_glob(p) && !reg_by_name(p)) {
+      printf_P(noreg,p);
+      return;
+    }
+  }
+  printf_P(PSTR("OK "));
+  first=1;
+  for (p=arg; p<end; p+=strlen(p)+1) {
+    if (!is_glob(p)) {
+      read_item(reg_by_name(p),&first);
+      continue;
+    }
+    for (i=0; (r=reg_number(i)); i++) {
+      reg_name(r,buf);
+      if (glob_match(p,buf)) read_item(r,&first);
+    }
+  }
+  putchar('\n');
+}
+
+/* CHANGES gen gives "OK gen name=value;name=value;..." for the
+   registers that have changed since generation gen, along with the
+   current generation to ask with next time.  If gen isn't one we have
+   reported, or is missing, it gives "OK gen *": read everything you
+   want, then carry on from gen. */
+static void changes_cmd(const char *arg)
+{
+  const uint8_t *map=NULL;
+  const struct reg *r;
+  unsigned int since;
+  uint8_t i,first;
+  if (sscanf_P(arg,PSTR("%u"),&since)==1) map=changes_since(since);
+  else changes_restart();
+  printf_P(PSTR("OK %u"),changes_generation);
+  if (!map) {
+    printf_P(PSTR(" *\n"));
+    return;
+  }
+  first=1;
+  for (i=0; (r=reg_number(i)); i++) {
+    if (!(map[i/8]&(1<<(i%8)))) continue;
+    if (first) putchar(' ');
+    read_item(r,&first);
+  }
+  putchar('\n');
 }
 
 static void help_cmd(const char *arg)
@@ -73,6 +209,26 @@ static void help_cmd(const char *arg)
   }
 }
 
+/* Keep a SET until COMMIT */
+static void stage(const struct reg *r, const char *name, const char *val)
+{
+  uint8_t len;
+  if (!reg_writable(r)) {
+    printf_P(PSTR("ERR write failed\n"));
+    return;
+  }
+  len=strlen(val)+1;
+  if (journal_len+sizeof(r)+len>TXN_JOURNAL_SIZE) {
+    printf_P(PSTR("ERR transaction full\n"));
+    return;
+  }
+  memcpy(&journal[journal_len],&r,sizeof(r));
+  journal_len+=sizeof(r);
+  memcpy(&journal[journal_len],val,len);
+  journal_len+=len;
+  printf_P(PSTR("OK %s staged\n"),name);
+}
+
 static void set_cmd(char *arg)
 {
   char *val;
@@ -90,6 +246,10 @@ static void set_cmd(char *arg)
     printf_P(noreg,arg);
     return;
   }
+  if (in_txn) {
+    stage(r,arg,val);
+    return;
+  }
   if (reg_write_string(r,val)) {
     printf_P(PSTR("ERR write failed\n"));
     return;
@@ -102,13 +262,267 @@ static void set_cmd(char *arg)
   }
 }
 
-static void scanbus_cmd(char *arg)
+static void begin_cmd(char *arg)
+{
+  (void)arg;
+  if (in_txn) {
+    printf_P(PSTR("ERR transaction already open\n"));
+    return;
+  }
+  in_txn=1;
+  journal_len=0;
+  printf_P(PSTR("OK begin\n"));
+}
+
+static void abort_cmd(char *arg)
+{
+  (void)arg;
+  if (!in_txn) {
+    printf_P(PSTR("ERR no transaction\n"));
+    return;
+  }
+  in_txn=0;
+  printf_P(PSTR("OK aborted\n"));
+}
+
+static void commit_cmd(char *arg)
+{
+  char undo[TXN_JOURNAL_SIZE];
+  char name[9];
+  uint8_t jp,up,i,n,count,slen;
+  const struct reg *r;
+  struct storage s;
+  (void)arg;
+  if (!in_txn) {
+    printf_P(PSTR("ERR no transaction\n"));
+    return;
+  }
+  in_txn=0;
+  /* Save the current values first, so that we can put them back */
+  for (jp=0, up=0, count=0; jp<journal_len; count++) {
+    memcpy(&r,&journal[jp],sizeof(r));
+    jp+=sizeof(r);
+    jp+=strlen(&journal[jp])+1;
+    s=reg_storage(r);
+    slen=s.slen;
+    if (up+slen>TXN_JOURNAL_SIZE) {
+      printf_P(PSTR("ERR transaction too big to commit\n"));
+      return;
+    }
+    reg_read_string(r,&undo[up],slen);
+    up+=strlen(&undo[up])+1;
+  }
+  for (jp=0, n=0; n<count; n++) {
+    memcpy(&r,&journal[jp],sizeof(r));
+    jp+=sizeof(r);
+    if (reg_write_string(r,&journal[jp])) break;
+    jp+=strlen(&journal[jp])+1;
+  }
+  if (n==count) {
+    printf_P(PSTR("OK %d committed\n"),count);
+    return;
+  }
+  reg_name(r,name);
+  /* Undo the writes that worked, latest first */
+  while (n--) {
+    for (i=0, jp=0, up=0; i<n; i++) {
+      jp+=sizeof(r);
+      jp+=strlen(&journal[jp])+1;
+      up+=strlen(&undo[up])+1;
+    }
+    memcpy(&r,&journal[jp],sizeof(r));
+    reg_write_string(r,&undo[up]);
+  }
+  printf_P(PSTR("ERR write of %s failed; nothing committed\n"),name);
+}
+
+static uint16_t cfg_crc(uint8_t n, const uint8_t *buf)
+{
+  uint16_t crc;
+  uint8_t i;
+  crc=_crc_xmodem_update(0,n);
+  for (i=0; i<CFG_CHUNK; i++) crc=_crc_xmodem_update(crc,buf[i]);
+  return crc;
+}
+
+static uint8_t cfg_is_protected(uint16_t a)
+{
+  uint8_t i;
+  uint16_t start;
+  for (i=0; i<sizeof(cfg_protected)/sizeof(cfg_protected[0]); i++) {
+    start=pgm_read_word(&cfg_protected[i].start);
+    if (a>=start && a<start+pgm_read_byte(&cfg_protected[i].len)) return 1;
+  }
+  return 0;
+}
+
+static int8_t hex_digit(char c)
+{
+  if (c>='0' && c<='9') return c-'0';
+  if (c>='a' && c<='f') return c-'a'+10;
+  if (c>='A' && c<='F') return c-'A'+10;
+  return -1;
+}
+
+/* CFGDUMP gives the layout version and number of chunks; CFGDUMP n
+   gives chunk n as "OK n data crc" */
+static void cfgdump_cmd(const char *arg)
+{
+  unsigned int n;
+  uint8_t buf[CFG_CHUNK];
+  uint8_t i;
+  if (sscanf_P(arg,PSTR("%u"),&n)!=1) {
+    printf_P(PSTR("OK layout %d chunks %d\n"),EEPROM_LAYOUT_VERSION,
+	     CFG_CHUNKS);
+    return;
+  }
+  if (n>=CFG_CHUNKS) {
+    printf_P(PSTR("ERR no such chunk\n"));
+    return;
+  }
+  ee_read_block(buf,(void *)(n*CFG_CHUNK),CFG_CHUNK);
+  printf_P(PSTR("OK %u "),n);
+  for (i=0; i<CFG_CHUNK; i++) printf_P(PSTR("%02x"),buf[i]);
+  printf_P(PSTR(" %04x\n"),cfg_crc(n,buf));
+}
+
+/* CFGLOAD version starts a load, then each chunk is sent in order as
+   CFGLOAD n data crc, in the form CFGDUMP gives them, and CFGLOAD END
+   finishes it.  Chunks are written as they arrive, but the new
+   configuration isn't used until END. */
+static void cfgload_cmd(const char *arg)
+{
+  unsigned int n,crc;
+  char hex[CFG_CHUNK*2+1];
+  uint8_t buf[CFG_CHUNK];
+  uint8_t i;
+  int8_t hi,lo;
+
+  if (strcmp_P(arg,PSTR(" END"))==0) {
+    if (cfg_next!=CFG_CHUNKS) {
+      printf_P(PSTR("ERR incomplete image\n"));
+      return;
+    }
+    cfg_next=CFG_IDLE;
+    settings_changed();
+    probe_config_changed();
+    control_config_changed();
+    relay_load_config();
+    printf_P(PSTR("OK loaded\n"));
+    return;
+  }
+  if (sscanf_P(arg,PSTR("%u %32s %x"),&n,hex,&crc)!=3) {
+    if (sscanf_P(arg,PSTR("%u"),&n)!=1) {
+      printf_P(PSTR("ERR CFGLOAD needs layout version, chunk or END\n"));
+    } else if (n!=EEPROM_LAYOUT_VERSION) {
+      printf_P(PSTR("ERR layout %d needed\n"),EEPROM_LAYOUT_VERSION);
+    } else {
+      cfg_next=0;
+      printf_P(PSTR("OK send %d chunks\n"),CFG_CHUNKS);
+    }
+    return;
+  }
+  if (cfg_next==CFG_IDLE) {
+    printf_P(PSTR("ERR no load started\n"));
+    return;
+  }
+  if (n!=cfg_next) {
+    printf_P(PSTR("ERR expected chunk %d\n"),cfg_next);
+    return;
+  }
+  if (strlen(hex)!=CFG_CHUNK*2) {
+    printf_P(PSTR("ERR bad chunk\n"));
+    return;
+  }
+  for (i=0; i<CFG_CHUNK; i++) {
+    hi=hex_digit(hex[i*2]);
+    lo=hex_digit(hex[i*2+1]);
+    if (hi<0 || lo<0) {
+      printf_P(PSTR("ERR bad chunk\n"));
+      return;
+    }
+    buf[i]=(hi<<4)|lo;
+  }
+  if (cfg_crc(n,buf)!=crc) {
+    printf_P(PSTR("ERR bad CRC\n"));
+    return;
+  }
+  for (i=0; i<CFG_CHUNK; i++) {
+    if (!cfg_is_protected(n*CFG_CHUNK+i)) {
+      ee_update_byte((void *)(n*CFG_CHUNK+i),buf[i]);
+    }
+  }
+  cfg_next++;
+  printf_P(PSTR("OK %u\n"),n);
+}
+
+/* BAUD is for every controller on the bus, selected or not; only the
+   selected one replies */
+static void baud_cmd(const char *arg)
+{
+  unsigned long bps;
+  if (sscanf_P(arg,PSTR("%lu"),&bps)!=1 || !serial_baud_possible(bps)) {
+    if (selected) printf_P(PSTR("ERR rate not possible\n"));
+    return;
+  }
+  if (selected) printf_P(PSTR("OK baud %lu\n"),bps);
+  serial_set_baud(bps);
+}
+
+/* Which mode the active settings came from, or -1 */
+static int8_t mode_index(void)
+{
+  struct mode m;
+  uint8_t n;
+  for (n=0; n<MODES; n++) {
+    if (read_mode(n,&m) && strncmp(m.name,settings.mode,sizeof(m.name))==0)
+      return n;
+  }
+  return -1;
+}
+
+/* POLLALL is for every controller with a bus address, while none is
+   selected.  Each replies in its own slot with
+     addr seq t0 v0 alarm mode
+   where seq counts the polls it has answered since reset, t0 is in
+   ten-thousandths of a degree, v0 is the valve state, alarm the alarm
+   bits in hex and mode the index of the active mode or -1. */
+static void pollall_cmd(const char *arg)
+{
+  static uint16_t seq;
+  unsigned int slot_ms;
+  char line[48],temp[12];
+  if (selected || sscanf_P(arg,PSTR("%u"),&slot_ms)!=1 ||
+      slot_ms==0 || slot_ms>SERIAL_SLOT_MAX_MS) {
+    return;
+  }
+  if (probes[0].temp==BAD_TEMP) {
+    strcpy_P(temp,PSTR("None"));
+  } else {
+    snprintf_P(temp,sizeof(temp),PSTR("%ld"),(long)probes[0].temp);
+  }
+  snprintf_P(line,sizeof(line),PSTR("%u %u %s %u %02x %d\n"),
+	     settings.addr,seq,temp,get_valve_state(0),alarm,mode_index());
+  if (serial_send_in_slot(line,slot_ms)) seq++;
+}
+
+static void mode_cmd(const char *arg)
+{
+  unsigned int n;
+  if (sscanf_P(arg,PSTR("%u"),&n)!=1 || n>=MODES || !apply_mode(n)) {
+    printf_P(PSTR("ERR no such mode\n"));
+    return;
+  }
+  printf_P(PSTR("OK mode %s\n"),settings.mode);
+}
+
+/* List the devices in the one-wire bus device table, enumerating the
+   bus first if the table isn't valid or a rescan is requested */
+static void scanbus(uint8_t rescan)
 {
   int device_count,i;
-  uint8_t addr[8];
   char buf[20];
-  (void)arg;
-  device_count=owb_count_devices();
+  device_count=owb_scan(rescan);
   if (device_count==-1) {
     printf_P(PSTR("ERR Bus shorted to ground\n"));
     return;
@@ -120,8 +534,7 @@ static void scanbus_cmd(char *arg)
   printf_P(PSTR("OK %d sensors found"),device_count);
   if (device_count>0) {
     for (i=0; i<device_count; i++) {
-      owb_get_addr(addr,i);
-      owb_format_addr(addr,buf,sizeof(buf));
+      owb_format_addr(owb_devices[i].addr,buf,sizeof(buf));
       printf_P(PSTR(" "));
       printf(buf);
     }
@@ -129,13 +542,41 @@ static void scanbus_cmd(char *arg)
   printf_P(PSTR("\n"));
 }
 
+static void scanbus_cmd(char *arg)
+{
+  (void)arg;
+  scanbus(0);
+}
+
+static void rescan_cmd(char *arg)
+{
+  (void)arg;
+  scanbus(1);
+}
+
 void process_command(void)
 {
   uint8_t len;
+  if ((len=serial_address_event())) {
+    select(len==SERIAL_ADDRESS_US);
+    return;
+  }
+  if (rxbuf[0]==FRAME_START) {
+    if (selected) frame_command();
+    return;
+  }
   if ((len=it_is(PSTR("SELECT ")))) {
     select_cmd(&rxbuf[len]);
     return;
   }
+  if ((len=it_is(PSTR("BAUD ")))) {
+    baud_cmd(&rxbuf[len]);
+    return;
+  }
+  if ((len=it_is(PSTR("POLLALL ")))) {
+    pollall_cmd(&rxbuf[len]);
+    return;
+  }
   if (selected) {
     if ((len=it_is(PSTR("READ ")))) {
       read_cmd(&rxbuf[len]);
@@ -143,11 +584,28 @@ void process_command(void)
       set_cmd(&rxbuf[len]);
     } else if ((len=it_is(PSTR("HELP ")))) {
       help_cmd(&rxbuf[len]);
+    } else if ((len=it_is(PSTR("BEGIN")))) {
+      begin_cmd(&rxbuf[len]);
+    } else if ((len=it_is(PSTR("COMMIT")))) {
+      commit_cmd(&rxbuf[len]);
+    } else if ((len=it_is(PSTR("ABORT")))) {
+      abort_cmd(&rxbuf[len]);
+    } else if ((len=it_is(PSTR("CFGDUMP")))) {
+      cfgdump_cmd(&rxbuf[len]);
+    } else if ((len=it_is(PSTR("CFGLOAD")))) {
+      cfgload_cmd(&rxbuf[len]);
+    } else if ((len=it_is(PSTR("CHANGES")))) {
+      changes_cmd(&rxbuf[len]);
+    } else if ((len=it_is(PSTR("MODE ")))) {
+      mode_cmd(&rxbuf[len]);
     } else if ((len=it_is(PSTR("SCANBUS")))) {
       scanbus_cmd(&rxbuf[len]);
+    } else if ((len=it_is(PSTR("RESCAN")))) {
+      rescan_cmd(&rxbuf[len]);
     } else {
       printf_P(PSTR("ERR Unknown command; try SELECT, READ, SET, "
-		    "HELP reg, SCANBUS\n"));
+		    "HELP reg, BEGIN, COMMIT, ABORT, CFGDUMP, CFGLOAD, CHANGES gen, "
+		    "MODE n, BAUD, POLLALL ms, SCANBUS, RESCAN\n"));
     }
   }
 }
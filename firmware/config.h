@@ -3,10 +3,53 @@
 
 #define SERIAL_RX_BUFSIZE 80
 #define SERIAL_TX_BUFSIZE 160
+/* Commands that can be received while one is being executed, plus one;
+   at least 2 */
+#define SERIAL_RX_SLOTS 2
+
+/* Version of eeprom-layout, checked by CFGLOAD; change it whenever the
+   layout changes so that old configuration images are turned away */
+#define EEPROM_LAYOUT_VERSION 3
+
+/* After BAUD changes the line rate, we go back to 9600 unless a valid
+   command arrives at the new rate within this many seconds */
+#define BAUD_FALLBACK_SECONDS 5
+
+/* Space for SETs staged between BEGIN and COMMIT */
+#define TXN_JOURNAL_SIZE 96
+
+/* CHANGES keeps state for this many registers; it must be at least the
+   number there are, which registers.c checks */
+#define CHANGES_REGISTERS (121+13*PROBES)
 
 #define BUTTON_REPEAT_INITIAL 10
 #define BUTTON_REPEAT 2
 
+/* Number of temperature probes, t0 to t(PROBES-1); at most 10, because
+   each adds 13 registers and there can be no more than 255.  This must
+   be a plain number: it's used to generate the probe registers. */
+#define PROBES 4
+
+/* Default time between probe reads, in tenths of a second */
 #define TEMPERATURE_PROBE_PERIOD 10
 
+/* Default exponential average weight for probes set to use it: each
+   reading moves the average 1/2^PROBE_DEFAULT_SHIFT of the way */
+#define PROBE_DEFAULT_SHIFT 2
+
+/* A probe that fails n times in a row is skipped for up to
+   2^(PROBE_BACKOFF_LIMIT-1)-1 read cycles */
+#define PROBE_BACKOFF_LIMIT 7
+
+#define OWB_MAX_DEVICES 10
+
+/* How often a running profile saves its place in eeprom, in minutes */
+#define PROFILE_SAVE_MINUTES 15
+
+/* How often valve statistics are saved in eeprom, in minutes */
+#define STATS_SAVE_MINUTES 60
+
+/* Default valve duty cycle window, in minutes */
+#define DUTY_WINDOW_DEFAULT 60
+
 #endif /* _config_h */
@@ -0,0 +1,540 @@
+#include <stdio.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <string.h>
+#include "control.h"
+#include "temp.h"
+#include "hardware.h"
+#include "registers.h"
+#include "alarm.h"
+#include "timer.h"
+#include "settings.h"
+#include "ee.h"
+
+struct loop loops[LOOPS];
+uint32_t relay_actuations[2];
+static uint8_t control_reload=1; /* Loop configuration needs loading */
+static uint8_t output_on[2]; /* Set relay energised, VALVE1 and VALVE2 */
+static uint16_t bucket_length; /* Seconds in each slice of duty window */
+static uint32_t last_second; /* Uptime when we last kept statistics */
+
+static const uint8_t set_pin[2]={VALVE1_SET,VALVE2_SET};
+static const uint8_t reset_pin[2]={VALVE1_RESET,VALVE2_RESET};
+static const uint8_t state_pin[2]={VALVE1_STATE,VALVE2_STATE};
+
+static void trigger_jog_timer(uint16_t t)
+{
+  cli();
+  jog_timer=t;
+  sei();
+}
+
+static void set_output(uint8_t output, uint8_t on)
+{
+  if (on && !output_on[output]) {
+    trigger_relay(set_pin[output]);
+    output_on[output]=1;
+    relay_actuations[output]++;
+  }
+  if (!on && output_on[output]) {
+    trigger_relay(reset_pin[output]);
+    output_on[output]=0;
+    relay_actuations[output]++;
+  }
+}
+
+/* Spring-return valve on one set of outputs */
+static void spring_drive(const struct loop *l)
+{
+  set_output(l->output,l->state);
+}
+
+static uint8_t spring_state(const struct loop *l)
+{
+  uint8_t v;
+  v=read_valve(state_pin[l->output]);
+  if (l->state) {
+    if (v) return VALVE_OPEN;
+    else return VALVE_OPENING;
+  } else {
+    if (v) return VALVE_CLOSING;
+    else return VALVE_CLOSED;
+  }
+}
+
+/* Ball valve: open on VALVE1, close on VALVE2 */
+static void ball_drive(const struct loop *l)
+{
+  /* De-energise one side before energising the other */
+  if (l->state) {
+    set_output(1,0);
+    set_output(0,1);
+  } else {
+    set_output(0,0);
+    set_output(1,1);
+  }
+}
+
+/* Ball valve with no limit sensors */
+static uint8_t ball_state(const struct loop *l)
+{
+  if (l->state) return VALVE_OPEN;
+  else return VALVE_CLOSED;
+}
+
+/* Ball valve with open limit sensor on VALVE1 and closed limit sensor
+   on VALVE2 */
+static uint8_t ball_limit_state(const struct loop *l)
+{
+  uint8_t v1,v2;
+  v1=read_valve(VALVE1_STATE);
+  v2=read_valve(VALVE2_STATE);
+  if (v1 && v2) return VALVE_ERROR;
+  if (l->state) {
+    if (v1) return VALVE_OPEN;
+    return VALVE_OPENING;
+  } else {
+    if (v2) return VALVE_CLOSED;
+    return VALVE_CLOSING;
+  }
+}
+
+static uint16_t read_pid_word(uint8_t offset, uint16_t def)
+{
+  uint16_t w;
+  w=ee_read_word((void *)PID_EEPROM+offset);
+  if (w==0xffff) return def;
+  return w;
+}
+
+static void load_pid(struct loop *l)
+{
+  uint8_t pid;
+  pid=(ee_read_byte((void *)PID_EEPROM+PID_MODE)==1);
+  l->kp=read_pid_word(PID_KP,0);
+  l->ki=read_pid_word(PID_KI,0);
+  l->kd=read_pid_word(PID_KD,0);
+  l->cycle=read_pid_word(PID_CYCLE,600);
+  if (l->cycle==0) l->cycle=1;
+  l->min=read_pid_word(PID_MIN,60);
+  if (l->min>l->cycle/2) l->min=l->cycle/2;
+  if (pid && !l->pid) {
+    /* Start afresh, with a new cycle at the next reading */
+    l->integral=0;
+    l->last=BAD_TEMP;
+    l->cycle_start=get_uptime()-l->cycle;
+  }
+  l->pid=pid;
+}
+
+/* Fetch the loop configuration from eeprom and choose the valve
+   drivers, so running a loop needs no eeprom reads */
+static void load_loops(void)
+{
+  struct loop *l;
+  uint8_t n;
+
+  l=&loops[0];
+  l->probe=0;
+  l->output=0;
+  l->main=1;
+  switch (settings.vtype) {
+  case 1: /* Ball valve, no limit sensors */
+    l->drive=ball_drive;
+    l->valve_state=ball_state;
+    l->sensed=0;
+    break;
+  case 2: /* Ball valve with limit sensors */
+    l->drive=ball_drive;
+    l->valve_state=ball_limit_state;
+    l->sensed=1;
+    break;
+  default: /* Spring-return valve on VALVE1, nothing on VALVE2 */
+    l->drive=spring_drive;
+    l->valve_state=spring_state;
+    l->sensed=1;
+    break;
+  }
+  l->s_hi=settings.set_hi;
+  l->s_lo=settings.set_lo;
+  l->a_hi=settings.alarm_hi;
+  l->a_lo=settings.alarm_lo;
+  l->j_hi=settings.jog_hi;
+  l->j_lo=settings.jog_lo;
+  load_pid(l);
+
+  for (n=1, l=&loops[1]; n<LOOPS; n++, l++) {
+    l->output=n;
+    l->probe=ee_read_byte((void *)LOOP_EEPROM(n)+LOOP_PROBE);
+    ee_read_block(&l->s_hi,(void *)LOOP_EEPROM(n)+LOOP_SET_HI,4);
+    ee_read_block(&l->s_lo,(void *)LOOP_EEPROM(n)+LOOP_SET_LO,4);
+    if (l->probe<PROBES && loops[0].drive==spring_drive) {
+      l->drive=spring_drive;
+      l->valve_state=spring_state;
+      l->sensed=1;
+    } else {
+      /* Release the outputs, unless loop 0 is using them */
+      if (loops[0].drive==spring_drive) set_output(n,0);
+      l->drive=NULL;
+      l->valve_state=NULL;
+      l->state=0;
+      l->desired=0;
+    }
+  }
+  n=ee_read_byte((void *)DUTY_WINDOW_EEPROM);
+  if (n==0 || n==0xff) n=DUTY_WINDOW_DEFAULT;
+  if (bucket_length!=(uint16_t)n*60/DUTY_BUCKETS) {
+    /* Start the duty cycle afresh with the new window */
+    bucket_length=(uint16_t)n*60/DUTY_BUCKETS;
+    for (l=loops; l<loops+LOOPS; l++) {
+      l->bucket_pos=0;
+      l->buckets_full=0;
+      l->bucket_time=0;
+      l->bucket_open=0;
+    }
+  }
+  control_reload=0;
+}
+
+uint8_t read_mode(uint8_t n, struct mode *m)
+{
+  if (n>=MODES) return 0;
+  ee_read_block(m,(void *)MODE_EEPROM(n),sizeof(*m));
+  /* Blank eeprom, or an empty name, means no mode */
+  if (m->name[0]==0 || m->name[0]==(char)0xff) return 0;
+  return 1;
+}
+
+/* Modes used to be kept as text: name, lo and hi at 0x060 and alarm
+   and jog points at 0x160, sixteen bytes a mode, each temperature as
+   four characters such as "18.5" */
+#define OLD_MODE_EEPROM(n) (0x060+(n)*16)
+#define OLD_MODE_POINTS(n) (0x160+(n)*16)
+
+static int32_t old_mode_point(uint16_t a)
+{
+  char buf[5];
+  float tf;
+  ee_read_block(buf,(void *)a,4);
+  buf[4]=0;
+  /* Anything that isn't a temperature was left alone by the old code */
+  if (buf[0]==(char)0xff || sscanf_P(buf,PSTR("%f"),&tf)!=1)
+    return MODE_UNSET;
+  return (int32_t)(tf*10000.0);
+}
+
+void modes_upgrade(void)
+{
+  struct mode m;
+  uint16_t a;
+  uint8_t n;
+  if (ee_read_byte((void *)MODE_EEPROM(0)+MODE_NAME)!=0xff) return;
+  n=ee_read_byte((void *)OLD_MODE_EEPROM(0));
+  if (n==0 || n==0xff) return; /* No old modes */
+  for (n=0; n<MODES; n++) {
+    ee_read_block(m.name,(void *)OLD_MODE_EEPROM(n),sizeof(m.name));
+    m.lo=old_mode_point(OLD_MODE_EEPROM(n)+8);
+    m.hi=old_mode_point(OLD_MODE_EEPROM(n)+12);
+    m.a_lo=old_mode_point(OLD_MODE_POINTS(n));
+    m.a_hi=old_mode_point(OLD_MODE_POINTS(n)+4);
+    m.j_lo=old_mode_point(OLD_MODE_POINTS(n)+8);
+    m.j_hi=old_mode_point(OLD_MODE_POINTS(n)+12);
+    ee_update_block(&m,(void *)MODE_EEPROM(n),sizeof(m));
+  }
+  /* The old space is used for other things now, which expect it to
+     start blank */
+  for (a=OLD_MODE_EEPROM(0); a<OLD_MODE_EEPROM(MODES); a++)
+    ee_update_byte((void *)a,0xff);
+  for (a=OLD_MODE_POINTS(0); a<OLD_MODE_POINTS(MODES); a++)
+    ee_update_byte((void *)a,0xff);
+}
+
+static void mode_point(int32_t *active, int32_t m)
+{
+  if (m!=MODE_UNSET) *active=m;
+}
+
+uint8_t apply_mode(uint8_t n)
+{
+  struct storage s;
+  struct mode m,active;
+  struct loop *l=&loops[0];
+  if (!read_mode(n,&m)) return 0;
+  /* Fetch the active settings in two blocks, change them, and write
+     back only the bytes that changed */
+  s=reg_storage(&set_hi);
+  ee_read_block(&active,(void *)s.loc.eeprom.start,MODE_ALARM_HI);
+  s=reg_storage(&alarm_hi);
+  ee_read_block(&active.a_hi,(void *)s.loc.eeprom.start,
+		    sizeof(active)-MODE_ALARM_HI);
+  mode_point(&active.hi,m.hi);
+  mode_point(&active.lo,m.lo);
+  memcpy(active.name,m.name,sizeof(active.name));
+  mode_point(&active.a_hi,m.a_hi);
+  mode_point(&active.a_lo,m.a_lo);
+  mode_point(&active.j_hi,m.j_hi);
+  mode_point(&active.j_lo,m.j_lo);
+  s=reg_storage(&set_hi);
+  ee_update_block(&active,(void *)s.loc.eeprom.start,MODE_ALARM_HI);
+  s=reg_storage(&alarm_hi);
+  ee_update_block(&active.a_hi,(void *)s.loc.eeprom.start,
+		      sizeof(active)-MODE_ALARM_HI);
+  /* The control loop can use the new settings straight away */
+  l->s_hi=active.hi;
+  l->s_lo=active.lo;
+  l->a_hi=active.a_hi;
+  l->a_lo=active.a_lo;
+  l->j_hi=active.j_hi;
+  l->j_lo=active.j_lo;
+  settings_changed();
+  return 1;
+}
+
+static uint32_t read_stat(uint16_t a)
+{
+  uint32_t v;
+  ee_read_block(&v,(void *)a,4);
+  if (v==0xffffffff) return 0; /* Blank eeprom */
+  return v;
+}
+
+static void save_stats(void)
+{
+  uint8_t n;
+  for (n=0; n<2; n++) {
+    ee_update_block(&relay_actuations[n],
+			(void *)STATS_EEPROM+STATS_RELAY_ACTS+n*4,4);
+  }
+  for (n=0; n<LOOPS; n++) {
+    ee_update_block(&loops[n].open_secs,
+			(void *)STATS_EEPROM+STATS_OPEN_SECS+n*4,4);
+  }
+}
+
+void control_init(void)
+{
+  uint8_t n;
+  for (n=0; n<2; n++) {
+    relay_actuations[n]=read_stat(STATS_EEPROM+STATS_RELAY_ACTS+n*4);
+  }
+  for (n=0; n<LOOPS; n++) {
+    loops[n].open_secs=read_stat(STATS_EEPROM+STATS_OPEN_SECS+n*4);
+  }
+  last_second=get_uptime();
+  load_loops();
+}
+
+/* Count a second of a loop's valve being open or closed */
+static void account_second(struct loop *l)
+{
+  uint8_t i,n;
+  uint32_t open;
+  if (l->state) {
+    l->open_secs++;
+    l->bucket_open++;
+  }
+  if (++l->bucket_time<bucket_length) return;
+  l->bucket[l->bucket_pos]=l->bucket_open;
+  if (++l->bucket_pos>=DUTY_BUCKETS) {
+    l->bucket_pos=0;
+    l->buckets_full=1;
+  }
+  l->bucket_time=0;
+  l->bucket_open=0;
+  /* Until the window has filled, use the slices we have */
+  n=l->buckets_full?DUTY_BUCKETS:l->bucket_pos;
+  open=0;
+  for (i=0; i<n; i++) open+=l->bucket[i];
+  l->duty=open*1000/((uint32_t)bucket_length*n);
+}
+
+void control_account(void)
+{
+  uint32_t now;
+  uint16_t ticks;
+  uint8_t v;
+  struct loop *l;
+
+  /* Time valves that report when they've finished moving */
+  ticks=get_ticks();
+  for (l=loops; l<loops+LOOPS; l++) {
+    if (!l->travelling || !l->drive) continue;
+    v=l->valve_state(l);
+    if (l->state && v==VALVE_OPEN) {
+      l->travel_open=ticks-l->travel_start;
+      l->travelling=0;
+    } else if (!l->state && v==VALVE_CLOSED) {
+      l->travel_close=ticks-l->travel_start;
+      l->travelling=0;
+    }
+  }
+
+  now=get_uptime();
+  while (last_second!=now) {
+    last_second++;
+    for (l=loops; l<loops+LOOPS; l++) {
+      if (l->drive) account_second(l);
+    }
+    if (last_second%(STATS_SAVE_MINUTES*60)==0) save_stats();
+  }
+}
+
+void control_config_changed(void)
+{
+  control_reload=1;
+}
+
+static int32_t clamp(int32_t x, int32_t lo, int32_t hi)
+{
+  if (x<lo) return lo;
+  if (x>hi) return hi;
+  return x;
+}
+
+/* Work out how much of the cycle the valve should be open, from the
+   error between reading t and the midpoint of the set points.  Working
+   in hundredths of a degree keeps every product inside an int32 with
+   gains up to 65535. */
+static void pid_update(struct loop *l, int32_t t)
+{
+  struct probe *p=&probes[l->probe];
+  int32_t e,d,u;
+
+  /* Positive error means too warm: open the valve to chill */
+  e=clamp((t-l->s_lo/2-l->s_hi/2)/100,-10000,10000);
+  u=(int32_t)l->kp*e/100;
+
+  /* The integral only covers what the proportional term can't, so
+     stop it winding up beyond full duty either way */
+  l->integral+=(int32_t)l->ki*e/100*p->period;
+  l->integral=clamp(l->integral,-1000L*600,1000L*600);
+  u+=l->integral/600;
+
+  /* Look ahead: a rising temperature opens the valve sooner */
+  if (l->last!=BAD_TEMP) {
+    d=clamp((t-l->last)/100*600/p->period,-10000,10000);
+    u+=(int32_t)l->kd*d/100;
+  }
+  l->last=t;
+
+  l->pid_duty=clamp(u,0,1000);
+}
+
+/* Time-proportioned valve: the duty is fixed at the start of each
+   cycle, and the valve stays open for that part of the cycle.  Times
+   shorter than the minimum are rounded away, so the valve is never
+   switched on or off for less than the minimum. */
+static uint8_t pid_state(struct loop *l)
+{
+  uint32_t now;
+  now=get_uptime();
+  if (now-l->cycle_start>=l->cycle) {
+    l->cycle_start=now;
+    l->on_time=(uint32_t)l->pid_duty*l->cycle/1000;
+    if (l->on_time<l->min) l->on_time=0;
+    if (l->cycle-l->on_time<l->min) l->on_time=l->cycle;
+  }
+  return (now-l->cycle_start)<l->on_time;
+}
+
+static void run_loop(struct loop *l)
+{
+  int32_t t;
+  uint8_t was;
+
+  t=probes[l->probe].temp;
+  was=l->state;
+
+  /* Don't be a thermostat if we don't have a reading */
+  if (t==BAD_TEMP) {
+    if (l->main) SET_ALARM(ALARM_NO_TEMPERATURE);
+    l->last=BAD_TEMP;
+    return;
+  }
+
+  if (l->main) {
+    UNSET_ALARM(ALARM_NO_TEMPERATURE);
+
+    /* Check alarm temperatures */
+    if (t>l->a_hi) {
+      SET_ALARM(ALARM_TEMPERATURE_HIGH);
+    } else {
+      UNSET_ALARM(ALARM_TEMPERATURE_HIGH);
+    }
+    if (t<l->a_lo) {
+      SET_ALARM(ALARM_TEMPERATURE_LOW);
+    } else {
+      UNSET_ALARM(ALARM_TEMPERATURE_LOW);
+    }
+  }
+
+  if (l->pid) {
+    pid_update(l,t);
+    l->desired=pid_state(l);
+  } else {
+    /* Be a thermostat, with valve opened to provide chilling */
+    if (t>l->s_hi) {
+      l->desired=1;
+    }
+    if (t<l->s_lo) {
+      l->desired=0;
+    }
+  }
+
+  l->state=l->desired;
+
+  /* Check "jog" temperatures.  If temperature is out of bounds, we
+     assume that our valve may be stuck and jiggle it to try to free
+     it.  We invert the valve state for jog/flip and then wait jog/wait
+     before trying again.  We have one timer for this, jog_timer,
+     which counts down to zero and then stays there until we reset it,
+     so only the main loop does this.
+  */
+  if (l->main) {
+    if (t<l->j_lo || t>l->j_hi) {
+      SET_ALARM(ALARM_VALVE_STUCK);
+      if (jog_timer==0) {
+	l->jiggling=!l->jiggling;
+	if (l->jiggling) {
+	  trigger_jog_timer(settings.jog_flip);
+	} else {
+	  trigger_jog_timer(settings.jog_wait);
+	}
+      }
+      if (l->jiggling) l->state=!l->state;
+    } else {
+      /* Temperature is within bounds.  If the flip timer expires, start
+	 the wait timer. */
+      UNSET_ALARM(ALARM_VALVE_STUCK);
+      if (l->jiggling && jog_timer==0) {
+	l->jiggling=0;
+	trigger_jog_timer(settings.jog_wait);
+      }
+    }
+  }
+
+  if (l->state!=was) {
+    l->moves++;
+    l->travelling=l->sensed;
+    l->travel_start=get_ticks();
+  }
+  l->drive(l);
+}
+
+void control_run(uint16_t due)
+{
+  uint8_t n;
+  struct loop *l;
+
+  if (control_reload) load_loops();
+  for (n=0, l=loops; n<LOOPS; n++, l++) {
+    if (l->drive && (due & ((uint16_t)1<<l->probe))) run_loop(l);
+  }
+}
+
+uint8_t get_valve_state(uint8_t loop)
+{
+  const struct loop *l=&loops[loop];
+  if (!l->valve_state) return VALVE_NONE;
+  return l->valve_state(l);
+}
@@ -0,0 +1,137 @@
+#ifndef _control_h
+#define _control_h
+
+#include <stdint.h>
+
+/* Control loops.  Each loop keeps one probe's reading between its set
+   points by driving a valve.  Loop 0 is the main loop: it uses t0,
+   the set, alarm and jog registers, and drives the valve described by
+   vtype.  Loop 1 can run a second spring-return valve on the VALVE2
+   outputs when loop 0 isn't using them. */
+#define LOOPS 2 /* One per set of valve outputs */
+
+/* Loop configuration in eeprom for loops other than loop 0; see
+   eeprom-layout */
+#define LOOP_EEPROM(n) (0x200+((n)-1)*16)
+#define LOOP_PROBE 0 /* Probe index; anything out of range means unused */
+#define LOOP_SET_HI 4
+#define LOOP_SET_LO 8
+
+/* Valve statistics saved in eeprom; see eeprom-layout */
+#define DUTY_WINDOW_EEPROM 0x28c /* Minutes in the duty cycle window */
+#define STATS_EEPROM 0x290
+#define STATS_RELAY_ACTS 0 /* uint32 per relay */
+#define STATS_OPEN_SECS 8 /* uint32 per loop */
+#define DUTY_BUCKETS 8
+
+/* Proportional control settings for loop 0; see eeprom-layout */
+#define PID_EEPROM 0x220
+#define PID_MODE 0 /* 1 for proportional control, anything else on/off */
+#define PID_KP 2 /* Per mille duty per degree */
+#define PID_KI 4 /* Per mille duty per degree-minute */
+#define PID_KD 6 /* Per mille duty per degree/minute */
+#define PID_CYCLE 8 /* Seconds in each on/off cycle */
+#define PID_MIN 10 /* Shortest time on or off, seconds */
+
+struct loop {
+  /* Valve driver, chosen when the configuration is loaded: drive()
+     sets the outputs to match state, and valve_state() returns one of
+     the VALVE_* values below.  drive is NULL if the loop is unused. */
+  void (*drive)(const struct loop *l);
+  uint8_t (*valve_state)(const struct loop *l);
+  uint8_t probe; /* Index into probes[] */
+  uint8_t output; /* 0 for the VALVE1 outputs, 1 for VALVE2 */
+  uint8_t main; /* Loop sets the alarms and jogs a stuck valve */
+  /* NB state and desired are separate because we don't want changes
+     to state made by the "jog" code to affect the desired state
+     hysteresis in the event that the probe is between the low and high
+     set points. */
+  uint8_t state; /* How we are driving the valve at the moment */
+  uint8_t desired; /* Desired valve state: 0=closed, 1=open */
+  uint8_t jiggling; /* Are we jiggling the valve to unstick it? */
+  int32_t s_hi,s_lo; /* Set points */
+  int32_t a_hi,a_lo; /* Alarm limits; main loop only */
+  int32_t j_hi,j_lo; /* Jog limits; main loop only */
+  uint16_t moves; /* Times the valve has been told to move */
+  uint8_t sensed; /* The valve reports when it has finished moving */
+  uint8_t travelling; /* Timing the valve's travel */
+  uint16_t travel_start; /* Ticks when it was told to move */
+  uint16_t travel_open,travel_close; /* Last travel times, tenths */
+  uint32_t open_secs; /* Total time the valve has been open */
+  /* The duty cycle is worked out over DUTY_BUCKETS slices of the
+     window, each holding how long the valve was open */
+  uint16_t bucket[DUTY_BUCKETS];
+  uint8_t bucket_pos,buckets_full;
+  uint16_t bucket_time,bucket_open; /* Seconds in current slice */
+  uint16_t duty; /* Per mille open over the window */
+  /* Proportional control: instead of switching at the set points, aim
+     for halfway between them and open the valve for a proportion of
+     each cycle */
+  uint8_t pid; /* Proportional control enabled */
+  uint16_t kp,ki,kd,cycle,min;
+  int32_t integral; /* Integral term, in per mille duty * 600 */
+  int32_t last; /* Previous reading, for the derivative term */
+  uint16_t pid_duty; /* Per mille of the cycle the valve should be open */
+  uint16_t on_time; /* Seconds open in the current cycle */
+  uint32_t cycle_start; /* Uptime at start of current cycle */
+};
+
+extern struct loop loops[LOOPS];
+
+/* Modes are sets of loop 0 set points that can be chosen from the
+   front panel or with the MODE command.  Each is a packed record in
+   eeprom laid out like the active settings: the first half as set/hi,
+   set/lo and mode at 0x050, the second as alarm/hi, alarm/lo, jog/hi
+   and jog/lo at 0x3d0.  A point of MODE_UNSET (blank eeprom) is left
+   as it is when the mode is applied. */
+#define MODES 6
+#define MODE_EEPROM(n) (0x2a0+(n)*32)
+#define MODE_UNSET ((int32_t)0xffffffff)
+struct mode {
+  int32_t hi,lo;
+  char name[8];
+  int32_t a_hi,a_lo,j_hi,j_lo;
+};
+#define MODE_HI 0
+#define MODE_LO 4
+#define MODE_NAME 8
+#define MODE_ALARM_HI 16
+#define MODE_ALARM_LO 20
+#define MODE_JOG_HI 24
+#define MODE_JOG_LO 28
+
+/* Read mode n; returns 0 if there is no such mode */
+extern uint8_t read_mode(uint8_t n, struct mode *m);
+
+/* Make mode n the active one; returns 0 if there is no such mode */
+extern uint8_t apply_mode(uint8_t n);
+
+/* Convert modes left in eeprom by firmware that kept them as text, if
+   there are no modes in the current form yet.  Call once at boot,
+   before anything reads the eeprom settings. */
+extern void modes_upgrade(void);
+
+/* Relay operations, for each set of valve outputs */
+extern uint32_t relay_actuations[2];
+
+/* Call once at boot */
+extern void control_init(void);
+
+/* Call every time round the main loop to keep the valve statistics */
+extern void control_account(void);
+
+/* Call after changing vtype or any loop's set points in eeprom */
+extern void control_config_changed(void);
+
+/* Run the loops whose probes are in the bitmap due */
+extern void control_run(uint16_t due);
+
+extern uint8_t get_valve_state(uint8_t loop);
+#define VALVE_CLOSED 0
+#define VALVE_OPENING 1
+#define VALVE_OPEN 2
+#define VALVE_CLOSING 3
+#define VALVE_ERROR 4
+#define VALVE_NONE 5 /* Loop unused */
+
+#endif /* _control_h */
@@ -0,0 +1,134 @@
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <util/atomic.h>
+#include "ee.h"
+
+#define EE_QUEUE 32
+struct ee_write {
+  uint16_t addr;
+  uint8_t value;
+};
+static volatile struct ee_write ee_queue[EE_QUEUE];
+static volatile uint8_t ee_head,ee_tail;
+
+/* Find a queued write to addr.  Called with interrupts disabled. */
+static volatile struct ee_write *ee_find(uint16_t addr)
+{
+  uint8_t i;
+  for (i=ee_tail; i!=ee_head; i=(i+1)%EE_QUEUE) {
+    if (ee_queue[i].addr==addr) return &ee_queue[i];
+  }
+  return NULL;
+}
+
+/* Start writing the oldest queued byte that needs it, or stop the
+   interrupt if there are none.  Called with interrupts disabled while
+   the eeprom is idle. */
+static void ee_next(void)
+{
+  uint8_t v;
+  while (ee_head!=ee_tail) {
+    EEAR=ee_queue[ee_tail].addr;
+    v=ee_queue[ee_tail].value;
+    ee_tail=(ee_tail+1)%EE_QUEUE;
+    EECR|=(1<<EERE);
+    if (EEDR!=v) {
+      EEDR=v;
+      EECR|=(1<<EEMPE);
+      EECR|=(1<<EEPE);
+      return;
+    }
+  }
+  EECR&=~(1<<EERIE);
+}
+
+ISR(EE_READY_vect)
+{
+  ee_next();
+}
+
+uint8_t ee_read_byte(const uint8_t *p)
+{
+  volatile struct ee_write *w;
+  for (;;) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      w=ee_find((uint16_t)p);
+      if (w) return w->value;
+      if (!(EECR&(1<<EEPE))) {
+	EEAR=(uint16_t)p;
+	EECR|=(1<<EERE);
+	return EEDR;
+      }
+    }
+  }
+}
+
+uint16_t ee_read_word(const uint16_t *p)
+{
+  uint16_t r;
+  ee_read_block(&r,p,2);
+  return r;
+}
+
+void ee_read_block(void *dst, const void *src, size_t n)
+{
+  uint8_t *d=dst;
+  const uint8_t *s=src;
+  while (n--) *d++=ee_read_byte(s++);
+}
+
+void ee_update_byte(uint8_t *p, uint8_t value)
+{
+  volatile struct ee_write *w;
+  uint8_t polled,idle,next;
+  /* Interrupts are off at boot, so nothing empties the queue unless
+     we do */
+  polled=!(SREG&(1<<SREG_I));
+  for (;;) {
+    ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+      w=ee_find((uint16_t)p);
+      if (w) {
+	w->value=value;
+	return;
+      }
+      idle=!(EECR&(1<<EEPE));
+      if (idle) {
+	EEAR=(uint16_t)p;
+	EECR|=(1<<EERE);
+	if (EEDR==value) return;
+      }
+      next=(ee_head+1)%EE_QUEUE;
+      if (next!=ee_tail) {
+	ee_queue[ee_head].addr=(uint16_t)p;
+	ee_queue[ee_head].value=value;
+	ee_head=next;
+	EECR|=(1<<EERIE);
+	return;
+      }
+      /* Queue full */
+      if (polled && idle) ee_next();
+    }
+  }
+}
+
+void ee_update_word(uint16_t *p, uint16_t value)
+{
+  ee_update_block(&value,p,2);
+}
+
+void ee_update_block(const void *src, void *dst, size_t n)
+{
+  const uint8_t *s=src;
+  uint8_t *d=dst;
+  while (n--) ee_update_byte(d++,*s++);
+}
+
+uint8_t ee_pending(void)
+{
+  uint8_t n;
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    n=(ee_head-ee_tail+EE_QUEUE)%EE_QUEUE;
+    if (EECR&(1<<EEPE)) n++;
+  }
+  return n;
+}
@@ -0,0 +1,26 @@
+#ifndef _ee_h
+#define _ee_h
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* Eeprom access.  Writes are queued and done in the background by the
+   EE_READY interrupt, so they return straight away unless the queue is
+   full.  Bytes that already hold the value being written are left
+   alone, and writing a byte that is still queued just changes the
+   queued value.  Reads return queued values, so everything must go
+   through these functions rather than the avr-libc ones.  Anything
+   still queued is lost if we reset. */
+#define EE_SIZE 1024
+
+extern uint8_t ee_read_byte(const uint8_t *p);
+extern uint16_t ee_read_word(const uint16_t *p);
+extern void ee_read_block(void *dst, const void *src, size_t n);
+extern void ee_update_byte(uint8_t *p, uint8_t value);
+extern void ee_update_word(uint16_t *p, uint16_t value);
+extern void ee_update_block(const void *src, void *dst, size_t n);
+
+/* Bytes waiting to be written, including one being written now */
+extern uint8_t ee_pending(void);
+
+#endif /* _ee_h */
@@ -0,0 +1,86 @@
+#include <stdio.h>
+#include <util/crc16.h>
+#include "frame.h"
+#include "serial.h"
+#include "registers.h"
+
+static uint16_t crc;
+
+static void send(uint8_t b)
+{
+  crc=_crc_xmodem_update(crc,b);
+  putchar(b);
+}
+
+static void reply_start(uint8_t len, uint8_t seq, uint8_t status)
+{
+  putchar(FRAME_START);
+  crc=0;
+  send(len+2);
+  send(seq);
+  send(status);
+}
+
+static void reply_end(void)
+{
+  uint16_t c=crc;
+  putchar(c>>8);
+  putchar(c&0xff);
+}
+
+static void reply_status(uint8_t seq, uint8_t status)
+{
+  reply_start(0,seq,status);
+  reply_end();
+}
+
+static void read_frame(uint8_t seq, const uint8_t *regs, uint8_t n)
+{
+  const struct reg *r;
+  uint8_t buf[REG_RAW_MAX];
+  uint16_t len;
+  uint8_t i,j,l;
+  /* Work out how long the reply will be first, since the length comes
+     at the start; each value is then read once, as it is sent */
+  for (i=0, len=0; i<n; i++) {
+    r=reg_number(regs[i]);
+    if (!r) {
+      reply_status(seq,FRAME_NO_REGISTER);
+      return;
+    }
+    len+=1+reg_raw_length(r);
+  }
+  if (len>0xff-2) {
+    reply_status(seq,FRAME_TOO_LONG);
+    return;
+  }
+  reply_start(len,seq,FRAME_OK);
+  for (i=0; i<n; i++) {
+    l=reg_read_raw(reg_number(regs[i]),buf);
+    send(l);
+    for (j=0; j<l; j++) send(buf[j]);
+  }
+  reply_end();
+}
+
+void frame_command(void)
+{
+  const uint8_t *f=(const uint8_t *)rxbuf;
+  uint8_t len,i;
+  uint16_t c;
+  len=f[1];
+  c=0;
+  for (i=1; i<len+2; i++) c=_crc_xmodem_update(c,f[i]);
+  if (len<2 || c!=((uint16_t)f[len+2]<<8|f[len+3])) {
+    reply_status(len?f[2]:0,FRAME_BAD_CRC);
+    return;
+  }
+  switch (f[3]) {
+  case FRAME_READ:
+    read_frame(f[2],&f[4],len-2);
+    break;
+  default:
+    reply_status(f[2],FRAME_BAD_COMMAND);
+    break;
+  }
+}
@@ -0,0 +1,35 @@
+#ifndef _frame_h
+#define _frame_h
+
+#include <stdint.h>
+
+/* Binary framed commands, for polling without formatting and parsing
+   text.  They can be sent instead of text commands at any time to a
+   selected controller.  A frame is:
+
+     FRAME_START, length, sequence number, command, data...,
+     CRC high byte, CRC low byte
+
+   where length counts the bytes from the sequence number to the end of
+   the data, and the CRC is CRC-16/XMODEM of the length byte through the
+   end of the data.  The reply is a frame of the same form with the
+   sequence number copied from the command and a FRAME_* status in
+   place of the command. */
+#define FRAME_START 0x01
+
+/* Read registers.  The data is a list of register numbers, as in the
+   order HELP lists them; the reply data is, for each register, a
+   length byte and then the value as stored (see reg_read_raw()).  A
+   register with no raw form has length 0. */
+#define FRAME_READ 'R'
+
+#define FRAME_OK 0
+#define FRAME_BAD_CRC 1
+#define FRAME_BAD_COMMAND 2
+#define FRAME_NO_REGISTER 3
+#define FRAME_TOO_LONG 4 /* Reply wouldn't fit in a frame */
+
+/* Deal with the frame in rxbuf */
+extern void frame_command(void);
+
+#endif /* _frame_h */
@@ -2,7 +2,6 @@
 #include <util/delay.h>
 #include <avr/pgmspace.h>
 #include <avr/interrupt.h>
-#include <avr/eeprom.h>
 
 #include "config.h"
 #include "serial.h"
@@ -14,57 +13,31 @@
 #include "timer.h"
 #include "setup.h"
 #include "temp.h"
+#include "control.h"
+#include "profile.h"
 #include "command.h"
 #include "alarm.h"
-
-static void mode_reg_copy(const char *template, int m, const char *dest)
-{
-  const struct reg *mr;
-  char mn[8];
-  char buf[5];
-  sprintf_P(mn,template,m);
-  mr=reg_by_name(mn);
-  if (!mr) return;
-  reg_read_string(mr,buf,5);
-  mr=reg_by_name_P(dest);
-  if (!mr) return;
-  reg_write_string(mr,buf);
-}
+#include "settings.h"
+#include "changes.h"
 
 static void choose_mode(void)
 {
-  const struct reg *mr;
-  char mn[8];
-  char name[9];
-  char lo[5];
-  char hi[5];
+  struct mode m;
   char buf[32];
-  int m;
+  uint8_t n;
   uint16_t timeout=0;
 
   BACKLIGHT_ON();
   ack_buttons();
 
   do {
-    for (m=0; ; m++) {
-      sprintf_P(mn,PSTR("m%d/name"),m);
-      mr=reg_by_name(mn);
-      if (!mr) {
-	m=0;
+    for (n=0; ; n++) {
+      if (!read_mode(n,&m)) {
+	n=0;
 	break;
       }
-      reg_read_string(mr,name,9);
-      if (name[0]==0) {
-	m=0;
-	break;
-      }
-      sprintf_P(mn,PSTR("m%d/lo"),m);
-      mr=reg_by_name(mn);
-      reg_read_string(mr,lo,5);
-      sprintf_P(mn,PSTR("m%d/hi"),m);
-      mr=reg_by_name(mn);
-      reg_read_string(mr,hi,5);
-      sprintf_P(buf,PSTR("%s\n%s-%s"),name,lo,hi);
+      snprintf_P(buf,sizeof(buf),PSTR("%.8s\n%.1f-%.1f"),m.name,
+		 (double)(m.lo/10000.0),(double)(m.hi/10000.0));
       lcd_message(buf);
       for (timeout=10000; timeout>0; timeout--) {
 	if (get_buttons()==K_UP) {
@@ -76,13 +49,7 @@ static void choose_mode(void)
 	  break;
 	} else if (get_buttons()==K_ENTER) {
 	  ack_buttons();
-	  reg_write_string(&set_lo,lo);
-	  reg_write_string(&set_hi,hi);
-	  reg_write_string(&mode,name);
-	  mode_reg_copy(PSTR("m%d/a/lo"),m,PSTR("alarm/lo"));
-	  mode_reg_copy(PSTR("m%d/a/hi"),m,PSTR("alarm/hi"));
-	  mode_reg_copy(PSTR("m%d/j/lo"),m,PSTR("jog/lo"));
-	  mode_reg_copy(PSTR("m%d/j/hi"),m,PSTR("jog/hi"));
+	  apply_mode(n);
 	  BACKLIGHT_OFF();
 	  return;
 	}
@@ -96,19 +63,15 @@ static void choose_mode(void)
 
 static void trigger_backlight(void)
 {
-  struct storage s;
-  s=reg_storage(&bl);
   cli();
-  backlight_timer=eeprom_read_word((void *)s.loc.eeprom.start);
+  backlight_timer=settings.bl;
   sei();
 }
 
 static void trigger_alarm(void)
 {
-  struct storage s;
-  s=reg_storage(&blalarm);
   cli();
-  alarm_timer=eeprom_read_byte((void *)s.loc.eeprom.start);
+  alarm_timer=settings.blalarm;
   sei();
 }
 
@@ -133,9 +96,12 @@ int main(void)
 
   owb_init();
 
-  /* Relays should both be off */
-  trigger_relay(VALVE1_RESET);
-  trigger_relay(VALVE2_RESET);
+  modes_upgrade();
+
+  /* Everything after this point reads its settings from RAM */
+  settings_init();
+
+  relay_init();
 
   serial_init(9600);
   hw_init_lcd();
@@ -145,15 +111,23 @@ int main(void)
   /* Hardware init complete; we can now enable interrupts */
   sei();
 
+  /* Relays should both be off.  The pulses are timed by interrupt, so
+     they can only be sent now. */
+  trigger_relay(VALVE1_RESET);
+  trigger_relay(VALVE2_RESET);
+
   lcd_init();
 
-  owb_start_temp_conversion();
+  owb_scan(0);
+  control_init();
+  profile_init();
+  changes_restart();
 
   /* This is the main loop.  We listen for keypresses all the time and
-     use them to drive a menu system.  Also, we wait for a 1s timer
-     expiry; when the timer expires we take a temperature reading and
-     initiate a new one. */
-  tprobe_timer=TEMPERATURE_PROBE_PERIOD;
+     use them to drive a menu system.  Also, read_probes() takes
+     temperature readings as each probe's read period expires.
+     One-wire bus transfers run in the background, so read_probes()
+     never holds up the rest of the loop. */
   trigger_backlight();
   for (;;) {
     /* Update display and backlight.  If there is an alarm, then we
@@ -180,12 +154,10 @@ int main(void)
     }
     if (get_buttons()) {
       if (get_buttons()==(K_UP|K_DOWN)) {
-	struct storage s;
 	/* We leave this main loop when entering setup mode because it
 	   requires dedicated access to the 1-wire bus.  This setup mode
 	   can be disabled by setting the fpsetup register to zero. */
-	s=reg_storage(&fpsetup);
-	if (eeprom_read_byte((void *)s.loc.eeprom.start)) {
+	if (settings.fpsetup) {
 	  sensor_setup();
 	}
       } else if (get_buttons()==(K_DOWN)) {
@@ -194,11 +166,10 @@ int main(void)
       ack_buttons();
       trigger_backlight();
     }
-    if (tprobe_timer==0) {
-      read_probes();
-      owb_start_temp_conversion();
-      tprobe_timer=TEMPERATURE_PROBE_PERIOD;
-    }
+    read_probes();
+    profile_run();
+    control_account();
+    serial_check_baud();
     if (rx_data_available()) {
       process_command();
       ack_rx_data();
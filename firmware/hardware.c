@@ -1,14 +1,81 @@
 /* Buttons and low-level LCD access */
 
 #include <util/delay.h>
+#include <util/atomic.h>
+#include <avr/interrupt.h>
 #include "hardware.h"
+#include "ee.h"
+
+/* Relay coils are pulsed from the Timer2 compare interrupt, which runs
+   every millisecond while there are pulses to send.  Pulses are sent
+   one at a time, with a millisecond gap between them, so the set and
+   reset coils of a valve can never be energised together. */
+#define RELAY_QUEUE 4
+#define NO_RELAY 0xff
+static volatile uint8_t relay_queue[RELAY_QUEUE];
+static volatile uint8_t relay_head,relay_tail;
+static volatile uint8_t relay_pin=NO_RELAY; /* Relay being pulsed */
+static volatile uint8_t relay_left; /* ms left of pulse, or gap after it */
+static uint8_t relay_ms; /* Pulse length */
+
+void relay_load_config(void)
+{
+  uint8_t ms;
+  ms=ee_read_byte((void *)RELAY_PULSE_EEPROM);
+  if (ms==0 || ms==0xff) ms=RELAY_PULSE_DEFAULT;
+  relay_ms=ms;
+}
+
+void relay_init(void)
+{
+  relay_load_config();
+  /* CTC mode, clk/64: 250 counts to the millisecond */
+  TCCR2A=(1<<WGM21);
+  OCR2A=249;
+  TCCR2B=(1<<CS22);
+}
+
+/* Start the next pulse, if there is one.  Called with interrupts
+   disabled. */
+static void relay_next(void)
+{
+  if (relay_head==relay_tail) {
+    TIMSK2=0;
+    return;
+  }
+  relay_pin=relay_queue[relay_tail];
+  relay_tail=(relay_tail+1)%RELAY_QUEUE;
+  relay_left=relay_ms;
+  OUTPUT_HIGH(PORTD, relay_pin);
+  TCNT2=0;
+  TIFR2=(1<<OCF2A);
+  TIMSK2=(1<<OCIE2A);
+}
+
+ISR(TIMER2_COMPA_vect)
+{
+  if (--relay_left) return;
+  if (relay_pin!=NO_RELAY) {
+    OUTPUT_LOW(PORTD, relay_pin);
+    relay_pin=NO_RELAY;
+    relay_left=1; /* Gap before the next pulse */
+    return;
+  }
+  relay_next();
+}
 
 void trigger_relay(uint8_t pin)
 {
-    OUTPUT_HIGH(PORTD, pin);
-    _delay_ms(4); /* Datasheet says 4ms max operation time */
-    OUTPUT_LOW(PORTD, pin);
-}  
+  uint8_t next;
+  next=(relay_head+1)%RELAY_QUEUE;
+  /* Only wait if several pulses are already waiting */
+  while (next==relay_tail);
+  ATOMIC_BLOCK(ATOMIC_RESTORESTATE) {
+    relay_queue[relay_head]=pin;
+    relay_head=next;
+    if (!(TIMSK2 & (1<<OCIE2A))) relay_next(); /* Timer idle */
+  }
+}
 
 /* 0 is closed, 1 is open */
 uint8_t read_valve(uint8_t pin)
@@ -15,7 +15,14 @@
 #define RS485_XMIT_ON() OUTPUT_HIGH(PORTD,PD2)
 #define RS485_XMIT_OFF() OUTPUT_LOW(PORTD,PD2)
 
+/* Queue a pulse on a relay coil; returns straight away.  Interrupts
+   must be enabled, as they end the pulse. */
 extern void trigger_relay(uint8_t pin);
+extern void relay_init(void);
+/* Call after changing the pulse length in eeprom */
+extern void relay_load_config(void);
+#define RELAY_PULSE_EEPROM 0x3e6 /* Pulse length in ms */
+#define RELAY_PULSE_DEFAULT 4 /* Datasheet says 4ms max operation time */
 extern uint8_t read_valve(uint8_t pin);
 
 #define VALVE1_SET PD4
@@ -1,10 +1,11 @@
 #include <stdio.h>
 #include <avr/pgmspace.h>
-#include <avr/eeprom.h>
 #include "registers.h"
 #include "hardware.h"
 #include "lcd_hw.h"
 #include "temp.h"
+#include "control.h"
+#include "settings.h"
 
 #define ROW1 0x00
 #define ROW2 0x40
@@ -32,22 +33,15 @@ static void var_str(const char *str)
 void lcd_home_screen(const char *status)
 {
   char buf[16];
-  struct storage s;
-  int32_t s_hi,s_lo;
   float tf,slf,shf;
   lcd_cmd(LCD_DISPCTL(1,0,0)); /* No cursor */
   lcd_cmd(LCD_DDADDR(ROW1));
   /* Top left is station name, up to 8 characters */
-  reg_read_string(&ident,buf,9);
-  var_str(buf);
+  var_str(settings.ident);
   lcd_data(' ');
   /* Now current set range */
-  s=reg_storage(&set_lo);
-  eeprom_read_block(&s_lo,(void *)s.loc.eeprom.start,4);
-  slf=s_lo/10000.0;
-  s=reg_storage(&set_hi);
-  eeprom_read_block(&s_hi,(void *)s.loc.eeprom.start,4);
-  shf=s_hi/10000.0;
+  slf=settings.set_lo/10000.0;
+  shf=settings.set_hi/10000.0;
   snprintf_P(buf,16,PSTR("%0.1f-%0.1f"),(double)slf,(double)shf);
   var_str(buf);
   lcd_data(' ');
@@ -62,21 +56,20 @@ void lcd_home_screen(const char *status)
     fixed_str(buf,16);
   } else {
     /* Bottom left is current temp, up to 5 characters */
-    if (t0_temp==BAD_TEMP) {
+    if (probes[0].temp==BAD_TEMP) {
       sprintf_P(buf,PSTR("XXXXX"));
     } else {
-      tf=t0_temp/10000.0;
+      tf=probes[0].temp/10000.0;
       snprintf_P(buf,9,PSTR("%0.1f"),(double)tf);
     }
     fixed_str(buf,5);
     lcd_data(' ');
     
     /* Current mode */
-    reg_read_string(&mode,buf,9);
-    fixed_str(buf,8);
+    fixed_str(settings.mode,8);
     lcd_data(' ');
     /* Bottom right is valve state as 1 character */
-    switch (get_valve_state()) {
+    switch (get_valve_state(0)) {
     case VALVE_CLOSED:
       buf[0]='-';
       break;
@@ -1,13 +1,27 @@
-/* The one-wire bus is connected to PB0.  It should only ever have
-   non-parasite-powered DS18B20s on it. */
+/* The one-wire bus is connected to PB0, which is also the Timer1
+   input capture pin.  It should only ever have non-parasite-powered
+   DS18B20s on it.
+
+   Bus transfers are run entirely from the Timer1 compare B interrupt,
+   so the main loop never waits for the bus.  Each bit slot takes two
+   interrupts: one to start the slot and one to end it.  Interrupts are
+   only disabled for the couple of microseconds between pulling the bus
+   low and releasing it at the start of a slot.  Rather than sampling
+   the bus at a precise time during read slots, we use the input
+   capture unit to timestamp the rising edge, so interrupt latency
+   caused by other interrupt handlers doesn't affect the bits we read.
+   Presence pulses after reset are detected the same way.
+*/
 
 #include <stdio.h>
+#include <string.h>
 #include <avr/io.h>
+#include <avr/interrupt.h>
 #include <util/delay.h>
-#include <util/atomic.h>
 
 #include "owb.h"
 #include "temp.h"
+#include "timer.h"
 #include "registers.h"
 
 #define OWB_READ() ( (PINB & (1<<PB0))==(1<<PB0))
@@ -17,15 +31,23 @@
 #define OWB_OUT()  ( DDRB |= (1 << PB0) )
 
 #define OW_RECOVERY_TIME         10 /* us; increase for longer wires */
+#define OW_RESET_TIME           480 /* us */
+#define OW_SLOT_TIME             60 /* us */
+#define OW_SAMPLE_TIME           13 /* us; slaves hold the bus at least 15us */
+#define OW_START_DELAY           20 /* us; delay before starting a transfer */
+
+#define US(t) ((uint16_t)((t)*TIMER1_TICKS_PER_US))
 
 /* General one-wire-bus commands */
 #define OWB_MATCH_ROM 0x55
 #define OWB_SKIP_ROM 0xcc
 #define OWB_SEARCH_ROM 0xf0
+#define OWB_ALARM_SEARCH 0xec
 
 /* DS18B20 commands */
 #define DS18X20_CONVERT_T 0x44
 #define DS18X20_READ 0xbe
+#define DS18X20_WRITE 0x4e
 #define DS18X20_READ_POWER 0xb4
 
 /* Error counters */
@@ -34,167 +56,266 @@ uint8_t owb_shorted_cnt; /* bus shorted */
 uint8_t owb_crcerr_cnt; /* bad CRC on temperature read */
 uint8_t owb_powererr_cnt; /* unpowered device found */
 
+struct owb_device owb_devices[OWB_MAX_DEVICES];
+uint8_t owb_device_count;
+volatile uint8_t owb_devices_valid;
+
+/* Transfer queue.  cur is the transfer in progress, or NULL if the bus
+   is idle; queue holds transfers waiting to start. */
+#define OWB_QUEUE_LEN 4
+static struct owb_xfer *cur;
+static struct owb_xfer *queue[OWB_QUEUE_LEN];
+static uint8_t qnext,qlen;
+
+/* Progress through the current transfer */
+#define PH_RESET_LOW 0 /* Holding the bus low to reset it */
+#define PH_PRESENCE 1 /* Waiting for a presence pulse */
+#define PH_SLOT 2 /* In a bit slot */
+#define PH_RECOVER 3 /* Between bit slots */
+#define PH_START 4 /* About to start a transfer */
+static uint8_t phase;
+static uint8_t pos,mask; /* Byte and bit in cur->buf */
+static uint8_t slot_bit; /* Bit written in the current slot */
+static uint16_t slot_start; /* Timer1 count at start of current slot */
+static uint8_t search_bits; /* ROM ID bits still to be found */
+static uint8_t search_step; /* 0=read bit, 1=read complement, 2=write */
+static uint8_t search_b; /* Bit we are going to write */
+static uint8_t next_diff;
+
 void owb_init(void)
 {
   OWB_HIGH();
   OWB_OUT();
 }
 
-/* Returns 0 for successful reset of at least one device; 1 for no devices
-   detected, 2 for bus shorted to 0v, 3 for bus shorted to +5v */
-static uint8_t owb_reset(void)
+static void owb_after(uint16_t ticks)
 {
-  uint8_t r;
-
-  /* Idle 1-wire bus is high.  Pull low for 480us to reset. */
-  OWB_LOW();
-  OWB_OUT();
-  _delay_us(20);
-  if (OWB_READ()==1) return 3;
-  _delay_us(460);
-
-  ATOMIC_BLOCK(ATOMIC_FORCEON) {
-    OWB_IN();
-    _delay_us(64);
-    r=OWB_READ(); /* 0 if any slave is present or bus is shorted, else 1 */
-  }
-  
-  /* After the presence pulse the slaves should all stop pulling down */
-  _delay_us(480 - 64);
-  if (OWB_READ()==0) {
-    record_error(&owb_shorted_cnt);
-    return 2;
-  }
-
-  if (r) record_error(&owb_missing_cnt);
-  return r;
+  OCR1B=TCNT1+ticks;
 }
 
-static uint8_t owb_bit_io(uint8_t b)
+/* Start the transfer in cur */
+static void owb_begin(void)
 {
-  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+  static uint8_t transfers;
+  cur->seq=++transfers;
+  pos=0;
+  mask=1;
+  search_bits=64;
+  search_step=0;
+  next_diff=0;
+  if (cur->flags & OWB_XFER_RESET) {
+    /* Idle 1-wire bus is high.  Pull low for 480us to reset. */
     OWB_LOW();
     OWB_OUT();
-    _delay_us(2);    // T_INT > 1usec accoding to timing-diagramm
-    if (b) {
-      OWB_HIGH();
-      OWB_IN(); /* Raise bus early to write a 1, keep it low to write a 0 */
-    }
-    _delay_us(13);
-    b=OWB_READ();
-    _delay_us(43);
-    OWB_HIGH();
-    OWB_IN();
-  } /* ATOMIC_BLOCK */
-  _delay_us(OW_RECOVERY_TIME);
-  return b;
+    phase=PH_RESET_LOW;
+    owb_after(US(OW_RESET_TIME));
+  } else {
+    phase=PH_RECOVER;
+    owb_after(US(OW_RECOVERY_TIME));
+  }
 }
 
-static uint8_t owb_byte_wr(uint8_t b)
+/* Finish the current transfer and start the next one, if any */
+static void owb_finish(uint8_t status)
 {
-  uint8_t i = 8, j;
-	
-  do {
-    j = owb_bit_io(b&1);
-    b >>= 1;
-    if (j) {
-      b |= 0x80;
-    }
-  } while(--i);
-	
-  return b;
+  OWB_HIGH();
+  OWB_IN();
+  if (status==OWB_DONE) cur->diff=next_diff;
+  cur->status=status;
+  if (qlen) {
+    cur=queue[qnext];
+    qnext=(qnext+1)%OWB_QUEUE_LEN;
+    qlen--;
+    owb_begin();
+  } else {
+    cur=NULL;
+    TIMSK1&=~(1<<OCIE1B);
+  }
 }
 
-static uint8_t owb_byte_rd(void)
+static void owb_next_bit(void)
 {
-  return owb_byte_wr(0xFF); 
+  mask<<=1;
+  if (!mask) {
+    mask=1;
+    pos++;
+  }
 }
 
-static uint8_t owb_rom_search( uint8_t diff, uint8_t *id )
+/* Start the next bit slot, or finish the transfer if there's nothing
+   left to do */
+static void owb_start_slot(void)
 {
-  uint8_t i, j, next_diff;
   uint8_t b;
-	
-  if (owb_reset()) {
-    return 0xff; /* No devices */
+  if (pos<cur->wlen) {
+    b=cur->buf[pos]&mask;
+  } else if ((cur->flags & OWB_XFER_SEARCH) && search_bits) {
+    b=(search_step==2)?search_b:1;
+  } else if (pos<cur->wlen+cur->rlen) {
+    b=1; /* Read slot */
+  } else {
+    owb_finish(OWB_DONE);
+    return;
   }
+  slot_bit=b?1:0;
+  TCCR1B|=(1<<ICES1); /* Capture the rising edge */
+  OWB_LOW();
+  OWB_OUT();
+  slot_start=TCNT1;
+  TIFR1=(1<<ICF1);
+  _delay_us(2);    // T_INT > 1usec accoding to timing-diagramm
+  if (b) {
+    OWB_HIGH();
+    OWB_IN(); /* Raise bus early to write a 1, keep it low to write a 0 */
+  }
+  phase=PH_SLOT;
+  OCR1B=slot_start+US(OW_SLOT_TIME);
+}
 
-  owb_byte_wr(OWB_SEARCH_ROM);
-  next_diff=0x00;
-
-  i=64; /* 64-bit ID */
-
-  do {
-    j=8; /* 8 bits */
-    do {
-      b=owb_bit_io(1); /* Read bit */
-      if (owb_bit_io(1)) { /* Read complement bit */
-	if (b) { /* Read 1 followed by 1 */
-	  return 0; /* Error; exit now */
+/* End the current bit slot and deal with what we read */
+static void owb_end_slot(void)
+{
+  uint8_t b;
+  OWB_HIGH();
+  OWB_IN();
+  /* If we released the bus and it went high again straight away, no
+     slave was holding it low: we read a 1. */
+  b=slot_bit && (TIFR1&(1<<ICF1)) &&
+    (uint16_t)(ICR1-slot_start)<US(OW_SAMPLE_TIME);
+
+  if (pos<cur->wlen) {
+    owb_next_bit();
+  } else if ((cur->flags & OWB_XFER_SEARCH) && search_bits) {
+    switch (search_step) {
+    case 0: /* Read bit */
+      search_b=b;
+      search_step=1;
+      break;
+    case 1: /* Read complement bit */
+      if (b) {
+	if (search_b) { /* Read 1 followed by 1 */
+	  owb_finish(OWB_ERR_SEARCH);
+	  return;
 	}
-      }
-      else {
-	if (!b) { /* Read 0 followed by 0 - clash at this location */
-	  if (diff > i || ((*id & 1) && diff != i)) {
-	    b = 1; /* Use 1 this time around */
-	    next_diff = i;  /* Use 0 next time */
+      } else {
+	if (!search_b) { /* Read 0 followed by 0 - clash at this location */
+	  if (cur->diff > search_bits ||
+	      ((cur->buf[pos]&mask) && cur->diff != search_bits)) {
+	    search_b = 1; /* Use 1 this time around */
+	    next_diff = search_bits; /* Use 0 next time */
 	  }
 	}
       }
-      owb_bit_io(b); /* Write the bit */
-      *id >>= 1;
-      if( b ) {
-	*id |= 0x80; /* Store the bit */
-      }
-      
-      i--;
-
-    } while(--j);
-
-    id++; /* Next byte */
-
-  } while (i);
+      search_step=2;
+      break;
+    default: /* Wrote the bit; store it */
+      if (search_b) cur->buf[pos]|=mask;
+      else cur->buf[pos]&=~mask;
+      owb_next_bit();
+      search_bits--;
+      search_step=0;
+      break;
+    }
+  } else {
+    if (b) cur->buf[pos]|=mask;
+    else cur->buf[pos]&=~mask;
+    owb_next_bit();
+  }
+  phase=PH_RECOVER;
+  owb_after(US(OW_RECOVERY_TIME));
+}
 
-  return next_diff; /* Call again with this as diff to fetch next address */
+ISR(TIMER1_COMPB_vect)
+{
+  switch (phase) {
+  case PH_RESET_LOW:
+    if (OWB_READ()==1) {
+      owb_devices_valid=0;
+      owb_finish(OWB_ERR_SHORTED_HIGH);
+      break;
+    }
+    /* Release the bus and look for a falling edge from a presence
+       pulse */
+    TCCR1B&=~(1<<ICES1);
+    TIFR1=(1<<ICF1);
+    OWB_IN();
+    phase=PH_PRESENCE;
+    owb_after(US(OW_RESET_TIME));
+    break;
+  case PH_PRESENCE:
+    /* After the presence pulse the slaves should all stop pulling down */
+    if (OWB_READ()==0) {
+      record_error(&owb_shorted_cnt);
+      owb_devices_valid=0;
+      owb_finish(OWB_ERR_SHORTED);
+    } else if (!(TIFR1&(1<<ICF1))) {
+      record_error(&owb_missing_cnt);
+      owb_devices_valid=0;
+      owb_finish(OWB_ERR_MISSING);
+    } else {
+      OWB_HIGH();
+      owb_start_slot();
+    }
+    break;
+  case PH_SLOT:
+    owb_end_slot();
+    break;
+  case PH_START:
+    owb_begin();
+    break;
+  default:
+    owb_start_slot();
+    break;
+  }
 }
 
-int owb_count_devices(void)
+void owb_submit(struct owb_xfer *x)
 {
-  uint8_t addr[8];
-  uint8_t diff=0xff;
-  uint8_t r;
-  int count;
-  
-  r=owb_reset();
-  if (r==2) return -1; /* Bus shorted to 0v */
-  if (r==3) return -2; /* Bus shorted to +5v */
-  for (count=1; count<10; count++) {
-    diff=owb_rom_search(diff,addr);
-    if (diff==0xff) return 0; /* No devices found */
-    if (diff==0) return count;
+  x->status=OWB_PENDING;
+  cli();
+  /* Block until there is room in the queue */
+  while (qlen==OWB_QUEUE_LEN) {
+    sei();
+    _delay_us(1);
+    cli();
+  }
+  if (cur) {
+    queue[(qnext+qlen)%OWB_QUEUE_LEN]=x;
+    qlen++;
+  } else {
+    cur=x;
+    phase=PH_START;
+    owb_after(US(OW_START_DELAY));
+    TIFR1=(1<<OCF1B);
+    TIMSK1|=(1<<OCIE1B);
   }
-  return count;
+  sei();
 }
 
-uint8_t owb_get_addr(uint8_t addr[8], uint8_t index)
+uint8_t owb_wait(struct owb_xfer *x)
 {
-  uint8_t diff=0xff;
-  do {
-    diff=owb_rom_search(diff,addr);
-    if (diff==0xff) return 0; /* Failure */
-    if (diff==0) {
-      /* Last device */
-      return (index==0);
-    }
-  }  while ((index--)>0);
-  return 1;
+  while (x->status==OWB_PENDING);
+  return x->status;
 }
 
-void owb_start_temp_conversion(void)
+/* Returns 0 for successful reset of at least one device; 1 for no devices
+   detected, 2 for bus shorted to 0v, 3 for bus shorted to +5v */
+static uint8_t owb_reset(void)
 {
-  owb_reset();
-  owb_byte_wr(OWB_SKIP_ROM);
-  owb_byte_wr(DS18X20_CONVERT_T);
+  struct owb_xfer x;
+  x.flags=OWB_XFER_RESET;
+  x.wlen=0;
+  x.rlen=0;
+  owb_submit(&x);
+  switch (owb_wait(&x)) {
+  case OWB_DONE:
+    return 0;
+  case OWB_ERR_SHORTED:
+    return 2;
+  case OWB_ERR_SHORTED_HIGH:
+    return 3;
+  }
+  return 1;
 }
 
 /* Dallas/Maxim 8-bit CRC over a buffer.  If the last byte of the buffer
@@ -220,54 +341,206 @@ static uint8_t owb_crc(const uint8_t *buf,int len)
   return crc;
 }
 
-static void owb_match_rom(const uint8_t *id)
+uint8_t owb_addr_unset(const uint8_t *id)
 {
   uint8_t i;
-  owb_byte_wr(OWB_MATCH_ROM);
   for (i=8; i>0; i--) {
-    owb_byte_wr(*id++);
+    if ((*id++)!=0xff) return 0;
   }
+  return 1;
 }
 
-static uint8_t is_null_id(const uint8_t *id)
+static struct owb_device *owb_find_device(const uint8_t *id)
 {
   uint8_t i;
-  for (i=8; i>0; i--) {
-    if ((*id++)!=0xff) return 0;
+  if (!owb_devices_valid) return NULL;
+  for (i=0; i<owb_device_count; i++) {
+    if (memcmp(owb_devices[i].addr,id,8)==0) return &owb_devices[i];
+  }
+  return NULL;
+}
+
+/* Set up a transfer that resets the bus, addresses the device with
+   the given ID (or all devices if id is NULL) and sends a command.
+   If the device is the only one on the bus we use SKIP ROM, which
+   saves sending the address. */
+static void owb_address(struct owb_xfer *x, const uint8_t *id, uint8_t cmd)
+{
+  x->flags=OWB_XFER_RESET;
+  x->rlen=0;
+  if (!id || (owb_devices_valid && owb_device_count==1 &&
+	      memcmp(owb_devices[0].addr,id,8)==0)) {
+    x->buf[0]=OWB_SKIP_ROM;
+    x->wlen=1;
+  } else {
+    x->buf[0]=OWB_MATCH_ROM;
+    memcpy(&x->buf[1],id,8);
+    x->wlen=9;
+  }
+  x->buf[x->wlen++]=cmd;
+}
+
+int owb_scan(uint8_t rescan)
+{
+  struct owb_xfer x,p;
+  struct owb_device *d;
+  uint8_t n=0,ok=1;
+
+  if (owb_devices_valid && !rescan) return owb_device_count;
+  owb_devices_valid=0;
+  owb_device_count=0;
+
+  switch (owb_reset()) {
+  case 1:
+    owb_devices_valid=1;
+    return 0; /* No devices found */
+  case 2:
+    return -1; /* Bus shorted to 0v */
+  case 3:
+    return -2; /* Bus shorted to +5v */
+  }
+
+  /* One search per device; each search starts from the ID found by
+     the previous one */
+  x.diff=0xff;
+  do {
+    x.flags=OWB_XFER_RESET|OWB_XFER_SEARCH;
+    x.buf[0]=OWB_SEARCH_ROM;
+    x.wlen=1;
+    x.rlen=0;
+    owb_submit(&x);
+    if (owb_wait(&x)!=OWB_DONE) {
+      ok=0;
+      break;
+    }
+    if (owb_crc(&x.buf[1],8)!=0) {
+      record_error(&owb_crcerr_cnt);
+      ok=0;
+      break;
+    }
+    d=&owb_devices[n++];
+    memcpy(d->addr,&x.buf[1],8);
+    owb_address(&p,d->addr,DS18X20_READ_POWER);
+    p.rlen=1;
+    owb_submit(&p);
+    if (owb_wait(&p)!=OWB_DONE) ok=0;
+    d->powered=(ok && p.buf[p.wlen]==0xff);
+    d->seen=get_uptime();
+  } while (ok && x.diff && n<OWB_MAX_DEVICES);
+
+  /* A table cut short by a fault isn't kept as valid, so the next
+     owb_scan() tries again */
+  owb_device_count=n;
+  owb_devices_valid=ok;
+  return n;
+}
+
+void owb_start_temp_conversion(void)
+{
+  static struct owb_xfer x;
+  if (owb_busy(&x)) return;
+  owb_convert_submit(&x,NULL);
+}
+
+void owb_convert_submit(struct owb_xfer *x, const uint8_t *id)
+{
+  owb_address(x,id,DS18X20_CONVERT_T);
+  owb_submit(x);
+}
+
+void owb_convert_poll_submit(struct owb_xfer *x)
+{
+  /* Read slots return 0 while a conversion is in progress */
+  x->flags=0;
+  x->wlen=0;
+  x->rlen=1;
+  owb_submit(x);
+}
+
+void owb_write_config_submit(struct owb_xfer *x, const uint8_t *id,
+			     int8_t th, int8_t tl, uint8_t res)
+{
+  owb_address(x,id,DS18X20_WRITE);
+  x->buf[x->wlen++]=th;
+  x->buf[x->wlen++]=tl;
+  x->buf[x->wlen++]=((res-9)<<5)|0x1f;
+  owb_submit(x);
+}
+
+void owb_alarm_search_submit(struct owb_xfer *x, uint8_t first)
+{
+  x->flags=OWB_XFER_RESET|OWB_XFER_SEARCH;
+  x->buf[0]=OWB_ALARM_SEARCH;
+  x->wlen=1;
+  x->rlen=0;
+  if (first) x->diff=0xff;
+  owb_submit(x);
+}
+
+uint8_t owb_search_found(struct owb_xfer *x)
+{
+  if (x->status!=OWB_DONE) return 0;
+  if (owb_crc(&x->buf[1],8)!=0) {
+    record_error(&owb_crcerr_cnt);
+    return 0;
   }
   return 1;
 }
 
+void owb_read_temp_submit(struct owb_xfer *x, const uint8_t *id)
+{
+  struct owb_device *d;
+  if (owb_addr_unset(id)) {
+    x->status=OWB_ERR_NOADDR;
+    return;
+  }
+  /* Power mode was checked when the bus was enumerated */
+  d=owb_find_device(id);
+  if (d && !d->powered) {
+    record_error(&owb_powererr_cnt);
+    x->status=OWB_ERR_POWER;
+    return;
+  }
+  owb_address(x,id,DS18X20_READ);
+  x->rlen=9;
+  owb_submit(x);
+}
+
 /* XXX not checked with negative temperatures */
+int32_t owb_read_temp_complete(struct owb_xfer *x)
+{
+  struct owb_device *d;
+  uint8_t *sp;
+  int16_t raw;
+  if (x->status!=OWB_DONE) return BAD_TEMP;
+  sp=&x->buf[x->wlen];
+  if (owb_crc(sp,9)!=0) { /* Bad CRC */
+    record_error(&owb_crcerr_cnt);
+    return BAD_TEMP;
+  }
+  if (x->buf[0]==OWB_SKIP_ROM) {
+    d=owb_devices_valid?&owb_devices[0]:NULL;
+  } else {
+    d=owb_find_device(&x->buf[1]);
+  }
+  if (d) d->seen=get_uptime();
+  raw=(sp[1]<<8)|sp[0];
+  /* Bits below the configured resolution are undefined */
+  raw&=~((1<<(3-((sp[4]>>5)&3)))-1);
+  return raw*625L;
+}
+
 int32_t owb_read_temp(const uint8_t *id)
 {
-  int32_t temp;
-  uint8_t i;
+  struct owb_xfer x;
+  int32_t temp=BAD_TEMP;
   uint8_t tries;
-  uint8_t sp[9];
-  if (is_null_id(id)) return BAD_TEMP;
-  for (tries=10; tries>0; tries--) {
-    if (owb_reset()) continue;
-    owb_match_rom(id);
-    owb_byte_wr(DS18X20_READ_POWER);
-    if (owb_byte_rd()!=0xff) { /* Not powered */
-      record_error(&owb_powererr_cnt);
-      continue;
-    }
-    if (owb_reset()) continue;
-    owb_match_rom(id);
-    owb_byte_wr(DS18X20_READ);
-    for (i=0; i<9; i++) {
-      sp[i]=owb_byte_rd();
-    }
-    if (owb_crc(sp,9)!=0) { /* Bad CRC */
-      record_error(&owb_crcerr_cnt);
-    } else {
-      temp=((sp[1]<<8)|sp[0])*625L;
-      return temp;
-    }
+  for (tries=OWB_READ_TRIES; tries>0 && temp==BAD_TEMP; tries--) {
+    owb_read_temp_submit(&x,id);
+    if (owb_wait(&x)!=OWB_DONE) break;
+    temp=owb_read_temp_complete(&x);
   }
-  return BAD_TEMP;
+  return temp;
 }
 
 static const char PROGMEM owb_addr_fstr[]="%02X%02X%02X%02X%02X%02X%02X%02X";
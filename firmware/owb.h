@@ -2,26 +2,133 @@
 #define _owb_h
 
 #include <stdlib.h>
+#include <stdint.h>
+#include "config.h"
 
 extern uint8_t owb_missing_cnt;
 extern uint8_t owb_shorted_cnt;
 extern uint8_t owb_crcerr_cnt;
 extern uint8_t owb_powererr_cnt;
 
+/* Bus transfers are run by the Timer1 compare B and input capture
+   interrupts.  A transfer is an optional bus reset, followed by
+   writing wlen bytes from buf, followed by either a ROM search or
+   reading rlen bytes.  Bytes read (or the ROM ID found by a search)
+   are stored in buf immediately after the bytes written.  Transfers
+   are queued and run in the order they were submitted; the caller
+   owns the structure and must not touch it until status is no longer
+   OWB_PENDING. */
+#define OWB_XFER_BUFSIZE 20
+
+#define OWB_XFER_RESET 0x01 /* Reset the bus before writing */
+#define OWB_XFER_SEARCH 0x02 /* Do a ROM search after writing */
+
+/* Transfer status */
+#define OWB_IDLE 0
+#define OWB_PENDING 1
+#define OWB_DONE 2
+#define OWB_ERR_MISSING 3 /* No presence pulse after reset */
+#define OWB_ERR_SHORTED 4 /* Bus shorted to 0v */
+#define OWB_ERR_SHORTED_HIGH 5 /* Bus shorted to +5v */
+#define OWB_ERR_SEARCH 6 /* No device responded during ROM search */
+#define OWB_ERR_NOADDR 7 /* Not submitted: address unset */
+#define OWB_ERR_POWER 8 /* Not submitted: device is parasite-powered */
+
+struct owb_xfer {
+  uint8_t flags;
+  uint8_t wlen;
+  uint8_t rlen;
+  /* For searches: on submission, the discrepancy returned by the
+     previous search (0xff for the first); on completion, the value to
+     pass next time, or 0 if this was the last device. */
+  uint8_t diff;
+  volatile uint8_t status;
+  /* Set as the transfer starts, from a count of transfers on the bus;
+     if two of ours have consecutive numbers, nothing else ran between
+     them */
+  uint8_t seq;
+  uint8_t buf[OWB_XFER_BUFSIZE];
+};
+
 extern void owb_init(void);
 
-/* Retrieve device address from bus given index; returns 1 for success
-   or 0 if there's no device at that index. */
-extern uint8_t owb_get_addr(uint8_t addr[8], uint8_t index);
+/* Queue a transfer; blocks only if the queue is full */
+extern void owb_submit(struct owb_xfer *x);
 
-/* Return number of devices on bus; -1 indicates bus shorted to 0v,
+/* Wait for a transfer to finish and return its status */
+extern uint8_t owb_wait(struct owb_xfer *x);
+
+#define owb_busy(x) ((x)->status==OWB_PENDING)
+
+/* Devices found on the bus.  The table is filled by a single ROM
+   search sweep, and is only thrown away when the bus faults (shorted,
+   or no devices present) or when a rescan is asked for. */
+struct owb_device {
+  uint8_t addr[8]; /* addr[0] is the family code */
+  uint8_t powered; /* 0 if the device is parasite-powered */
+  uint32_t seen; /* Uptime when we last heard from the device */
+};
+extern struct owb_device owb_devices[OWB_MAX_DEVICES];
+extern uint8_t owb_device_count;
+extern volatile uint8_t owb_devices_valid;
+
+/* Return number of devices on bus, enumerating it if the device
+   table isn't valid or rescan is set; -1 indicates bus shorted to 0v,
    -2 indicates bus shorted to +5v */
-extern int owb_count_devices(void);
+extern int owb_scan(uint8_t rescan);
+
+/* Returns 1 if a bus address is unset (all ones, as in blank eeprom) */
+extern uint8_t owb_addr_unset(const uint8_t *id);
 
-/* Start temperature conversion */
+/* Start temperature conversion on all devices; returns immediately */
 extern void owb_start_temp_conversion(void);
 
-/* Read temperature - returns BAD_TEMP if reading failed */
+/* Queue a temperature conversion on one device, or on all devices if
+   id is NULL */
+extern void owb_convert_submit(struct owb_xfer *x, const uint8_t *id);
+
+/* Queue a check on the conversion started by the immediately preceding
+   transfer; when the transfer is done, owb_convert_done() is true if
+   the conversion has finished.  That is only so if nothing else has
+   used the bus since the conversion was started, which the caller can
+   tell from seq; after a reset, read slots return 1 whatever the
+   conversion is doing. */
+extern void owb_convert_poll_submit(struct owb_xfer *x);
+#define owb_convert_done(x) ((x)->status==OWB_DONE && (x)->buf[0]!=0)
+
+/* Queue a write of the alarm bytes and resolution (9-12 bits) to a
+   device's scratchpad */
+extern void owb_write_config_submit(struct owb_xfer *x, const uint8_t *id,
+				    int8_t th, int8_t tl, uint8_t res);
+
+/* Queue a search for devices whose last conversion was outside their
+   alarm limits; set first for the first search of a sweep.  When the
+   transfer is done, owb_search_found() returns 1 if a device was found,
+   and its ID is at owb_search_id(); if x->diff is not zero, submit
+   again to find the next one. */
+extern void owb_alarm_search_submit(struct owb_xfer *x, uint8_t first);
+extern uint8_t owb_search_found(struct owb_xfer *x);
+#define owb_search_id(x) (&(x)->buf[1])
+
+/* How many times to try reading a probe that returns a bad CRC */
+#define OWB_READ_TRIES 2
+
+/* Queue a temperature read.  If there's no point reading - the
+   address is unset, or the device is known to be parasite-powered -
+   nothing is queued and status is set to OWB_ERR_NOADDR or
+   OWB_ERR_POWER straight away.  If the device is the only one on the
+   bus it is read using SKIP ROM. */
+extern void owb_read_temp_submit(struct owb_xfer *x, const uint8_t *id);
+
+/* Collect the result of a finished read - returns BAD_TEMP if reading
+   failed */
+extern int32_t owb_read_temp_complete(struct owb_xfer *x);
+
+/* Resolution (9-12 bits) reported by a successful read */
+#define owb_read_temp_res(x) ((((x)->buf[(x)->wlen+4]>>5)&3)+9)
+
+/* Read temperature, waiting for the result - returns BAD_TEMP if
+   reading failed */
 extern int32_t owb_read_temp(const uint8_t *id);
 
 /* Format a bus address for output */
@@ -0,0 +1,152 @@
+#include "profile.h"
+#include "control.h"
+#include "registers.h"
+#include "timer.h"
+#include "settings.h"
+#include "ee.h"
+
+uint8_t profile_step=0xff;
+uint32_t profile_left;
+static uint8_t step_type;
+static int32_t step_temp; /* Where the step ends up */
+static int32_t step_from; /* Where the step started */
+static uint32_t step_length; /* Seconds; 0 means for ever */
+static uint32_t step_elapsed; /* Seconds into the step */
+static int32_t band; /* Gap between the set points */
+static uint32_t last_second; /* Uptime when we last ran */
+
+static void save_state(void)
+{
+  ee_update_byte((void *)PROFILE_STATE+PROFILE_RUN,
+		     profile_step!=0xff);
+  ee_update_byte((void *)PROFILE_STATE+PROFILE_STEPNO,profile_step);
+  ee_update_word((void *)PROFILE_STATE+PROFILE_MINUTES,
+		     step_elapsed/60);
+  ee_update_block(&step_from,(void *)PROFILE_STATE+PROFILE_FROM,4);
+  ee_update_block(&band,(void *)PROFILE_STATE+PROFILE_BAND,4);
+}
+
+/* Where the profile says the set points should be now */
+static void set_points(int32_t *lo, int32_t *hi)
+{
+  int32_t t,d;
+  uint16_t f;
+  t=step_temp;
+  if (step_type==STEP_RAMP) {
+    /* f is how far along the ramp we are, in 1024ths; the most
+       a step can last, 65535 minutes, is under 2^22 seconds */
+    f=(step_elapsed<<10)/step_length;
+    d=step_temp-step_from;
+    t=step_from+(d>>10)*f+((d&1023)*f>>10);
+  }
+  *lo=t-band/2;
+  *hi=*lo+band;
+}
+
+static void save_set_points(void)
+{
+  struct storage s;
+  s=reg_storage(&set_lo);
+  ee_update_block(&settings.set_lo,(void *)s.loc.eeprom.start,4);
+  s=reg_storage(&set_hi);
+  ee_update_block(&settings.set_hi,(void *)s.loc.eeprom.start,4);
+}
+
+/* Move loop 0's set points, and the settings, to where the profile
+   says they should be now.  They change in RAM every second, but are
+   only written to eeprom when save is set, to spare it during long
+   ramps. */
+static void apply(uint8_t save)
+{
+  set_points(&settings.set_lo,&settings.set_hi);
+  loops[0].s_lo=settings.set_lo;
+  loops[0].s_hi=settings.set_hi;
+  if (save) {
+    save_set_points();
+    save_state();
+    settings_changed();
+  }
+}
+
+void profile_settings_loaded(void)
+{
+  if (profile_step==0xff) return;
+  set_points(&settings.set_lo,&settings.set_hi);
+}
+
+static void start_step(uint8_t n, int32_t from, uint32_t elapsed)
+{
+  if (n>=PROFILE_STEPS) {
+    profile_stop();
+    return;
+  }
+  step_type=ee_read_byte((void *)PROFILE_STEP(n)+STEP_TYPE);
+  ee_read_block(&step_temp,(void *)PROFILE_STEP(n)+STEP_TEMP,4);
+  step_length=(uint32_t)60*
+    ee_read_word((void *)PROFILE_STEP(n)+STEP_TIME);
+  if (step_type!=STEP_HOLD && step_type!=STEP_RAMP) {
+    profile_stop();
+    return;
+  }
+  /* A ramp taking no time is just a change of temperature */
+  if (step_type==STEP_RAMP && step_length==0) step_type=STEP_HOLD;
+  profile_step=n;
+  step_from=from;
+  step_elapsed=elapsed;
+  last_second=get_uptime();
+  profile_left=step_length?step_length-elapsed:0;
+  apply(1);
+}
+
+void profile_start(void)
+{
+  band=settings.set_hi-settings.set_lo;
+  start_step(0,settings.set_lo+band/2,0);
+}
+
+void profile_stop(void)
+{
+  uint8_t was_running=profile_step!=0xff;
+  profile_step=0xff;
+  profile_left=0;
+  ee_update_byte((void *)PROFILE_STATE+PROFILE_RUN,0);
+  /* Leave the set points where the profile got to, not where it last
+     saved them */
+  if (was_running) {
+    save_set_points();
+    settings_changed();
+  }
+}
+
+void profile_init(void)
+{
+  uint16_t minutes;
+  int32_t from;
+  if (ee_read_byte((void *)PROFILE_STATE+PROFILE_RUN)!=1) return;
+  minutes=ee_read_word((void *)PROFILE_STATE+PROFILE_MINUTES);
+  ee_read_block(&from,(void *)PROFILE_STATE+PROFILE_FROM,4);
+  ee_read_block(&band,(void *)PROFILE_STATE+PROFILE_BAND,4);
+  start_step(ee_read_byte((void *)PROFILE_STATE+PROFILE_STEPNO),
+	     from,(uint32_t)60*minutes);
+}
+
+void profile_run(void)
+{
+  uint32_t now,before;
+
+  if (profile_step==0xff) return;
+  now=get_uptime();
+  if (now==last_second) return;
+  before=step_elapsed;
+  step_elapsed+=now-last_second;
+  last_second=now;
+
+  if (step_length && step_elapsed>=step_length) {
+    start_step(profile_step+1,step_temp,0);
+    return;
+  }
+  if (step_length) profile_left=step_length-step_elapsed;
+  /* Save our place every few minutes */
+  apply(step_elapsed/(PROFILE_SAVE_MINUTES*60)!=
+	before/(PROFILE_SAVE_MINUTES*60));
+}
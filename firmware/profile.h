@@ -0,0 +1,51 @@
+#ifndef _profile_h
+#define _profile_h
+
+#include <stdint.h>
+#include "config.h"
+
+/* A fermentation profile is a list of steps in eeprom, each of which
+   moves the set points of loop 0.  The set points are kept
+   set/hi-set/lo apart, centred on the step's temperature.  A hold
+   step goes straight to its temperature and stays there for its time
+   (for ever if the time is zero); a ramp step moves steadily from the
+   previous temperature to its own over its time.  The profile ends at
+   the first step that is neither. */
+#define PROFILE_STEPS 8
+#define PROFILE_STEP(n) (0x240+(n)*8)
+#define STEP_TEMP 0 /* int32 ten-thousandths of a degree */
+#define STEP_TIME 4 /* uint16 minutes */
+#define STEP_TYPE 6
+
+#define STEP_END 0
+#define STEP_HOLD 1
+#define STEP_RAMP 2
+
+/* Where we are in the profile, saved in eeprom so it survives a
+   reset; see eeprom-layout */
+#define PROFILE_STATE 0x280
+#define PROFILE_RUN 0 /* 1 if the profile is running */
+#define PROFILE_STEPNO 1
+#define PROFILE_MINUTES 2 /* uint16 minutes into the step */
+#define PROFILE_FROM 4 /* int32 temperature the current step started from */
+#define PROFILE_BAND 8 /* int32 gap between the set points */
+
+extern uint8_t profile_step; /* Current step, or 0xff if not running */
+extern uint32_t profile_left; /* Seconds left in current step */
+
+/* Call once at boot, after control_init() */
+extern void profile_init(void);
+
+/* Call every time round the main loop */
+extern void profile_run(void);
+
+/* settings_changed() calls this after reloading the settings from
+   eeprom, where a running profile only saves its set points now and
+   then; it puts the current ones back */
+extern void profile_settings_loaded(void);
+
+/* Start the profile from the first step, or stop it */
+extern void profile_start(void);
+extern void profile_stop(void);
+
+#endif /* _profile_h */
@@ -4,13 +4,18 @@
 #include <string.h>
 #include <inttypes.h>
 #include <avr/pgmspace.h>
-#include <avr/eeprom.h>
 #include <util/atomic.h>
 #include "registers.h"
 #include "owb.h"
 #include "temp.h"
+#include "control.h"
+#include "profile.h"
 #include "hardware.h"
 #include "alarm.h"
+#include "settings.h"
+#include "ee.h"
+#include "changes.h"
+#include "serial.h"
 
 static void eeprom_string_read(const struct reg *reg, char *buf, size_t len)
 {
@@ -18,7 +23,7 @@ static void eeprom_string_read(const struct reg *reg, char *buf, size_t len)
   char *tbuf;
   s=reg_storage(reg);
   tbuf=alloca(s.slen);
-  eeprom_read_block(tbuf,(void *)s.loc.eeprom.start,s.loc.eeprom.length);
+  ee_read_block(tbuf,(void *)s.loc.eeprom.start,s.loc.eeprom.length);
   tbuf[s.slen-1]=0;
   if (tbuf[0]==-1) tbuf[0]=0; /* Uninitialised eeprom - return empty string */
   strncpy(buf,tbuf,len);
@@ -29,7 +34,7 @@ static uint8_t eeprom_string_write(const struct reg *reg, const char *buf)
 {
   struct storage s;
   s=reg_storage(reg);
-  eeprom_write_block(buf,(void *)s.loc.eeprom.start,s.loc.eeprom.length);
+  ee_update_block(buf,(void *)s.loc.eeprom.start,s.loc.eeprom.length);
   return 0;
 }
 
@@ -39,10 +44,10 @@ static void eeprom_uint32_read_bigendian(const struct reg *reg,
   uint32_t r;
   struct storage s;
   s=reg_storage(reg);
-  r=( ((uint32_t)eeprom_read_byte((void *)s.loc.eeprom.start+0)<<24) |
-      ((uint32_t)eeprom_read_byte((void *)s.loc.eeprom.start+1)<<16) |
-      ((uint32_t)eeprom_read_byte((void *)s.loc.eeprom.start+2)<<8) |
-      ((uint32_t)eeprom_read_byte((void *)s.loc.eeprom.start+3)<<0) );
+  r=( ((uint32_t)ee_read_byte((void *)s.loc.eeprom.start+0)<<24) |
+      ((uint32_t)ee_read_byte((void *)s.loc.eeprom.start+1)<<16) |
+      ((uint32_t)ee_read_byte((void *)s.loc.eeprom.start+2)<<8) |
+      ((uint32_t)ee_read_byte((void *)s.loc.eeprom.start+3)<<0) );
   snprintf_P(buf,len,PSTR("%" PRIu32),r);
 }
 
@@ -51,7 +56,7 @@ static void eeprom_uint16_read(const struct reg *reg, char *buf, size_t len)
   uint16_t r;
   struct storage s;
   s=reg_storage(reg);
-  r=eeprom_read_word((void *)s.loc.eeprom.start);
+  r=ee_read_word((void *)s.loc.eeprom.start);
   snprintf_P(buf,len,PSTR("%" PRIu16),r);
 }
 
@@ -60,7 +65,7 @@ static uint8_t eeprom_uint16_write(const struct reg *reg, const char *buf)
   struct storage s=reg_storage(reg);
   uint16_t r;
   if (sscanf_P(buf,PSTR("%u"),&r)!=1) return 1;
-  eeprom_write_word((void *)s.loc.eeprom.start,r);
+  ee_update_word((void *)s.loc.eeprom.start,r);
   return 0;
 }
 
@@ -69,16 +74,16 @@ static void eeprom_uint8_read(const struct reg *reg, char *buf, size_t len)
   uint8_t r;
   struct storage s;
   s=reg_storage(reg);
-  r=eeprom_read_byte((void *)s.loc.eeprom.start);
+  r=ee_read_byte((void *)s.loc.eeprom.start);
   snprintf_P(buf,len,PSTR("%" PRIu8),r);
 }
 
 static uint8_t eeprom_uint8_write(const struct reg *reg, const char *buf)
 {
   struct storage s=reg_storage(reg);
-  uint8_t r;
-  if (sscanf_P(buf,PSTR("%u"),&r)!=1) return 1;
-  eeprom_write_byte((void *)s.loc.eeprom.start,r);
+  unsigned int r; /* %u needs an int's worth of space */
+  if (sscanf_P(buf,PSTR("%u"),&r)!=1 || r>0xff) return 1;
+  ee_update_byte((void *)s.loc.eeprom.start,r);
   return 0;
 }
 
@@ -103,7 +108,7 @@ static void owb_addr_read(const struct reg *reg, char *buf, size_t len)
   struct storage s;
   uint8_t addr[8];
   s=reg_storage(reg);
-  eeprom_read_block(addr,(void *)s.loc.eeprom.start,8);
+  ee_read_block(addr,(void *)s.loc.eeprom.start,8);
   owb_format_addr(addr,buf,len);
 }
 
@@ -113,7 +118,7 @@ static uint8_t owb_addr_write(const struct reg *reg, const char *buf)
   uint8_t addr[8];
   s=reg_storage(reg);
   if (owb_scan_addr(addr,buf)) {
-    eeprom_write_block(addr,(void *)s.loc.eeprom.start,8);
+    ee_update_block(addr,(void *)s.loc.eeprom.start,8);
     return 0;
   }
   return 1;
@@ -142,12 +147,28 @@ static void eeprom_temperature_string_read(const struct reg *reg,
   s=reg_storage(reg);
   int32_t t;
   float tf;
-  eeprom_read_block(&t,(void *)s.loc.eeprom.start,4);
+  ee_read_block(&t,(void *)s.loc.eeprom.start,4);
   tf=t/10000.0;
   snprintf_P(buf,len,PSTR("%f"),(double)tf);
   buf[len-1]=0;
 }
 
+/* set/hi and set/lo read the settings in RAM rather than eeprom: a
+   running profile moves them every second but only saves them now and
+   then */
+static int32_t *setpoint(const struct reg *reg)
+{
+  return reg==&set_hi?&settings.set_hi:&settings.set_lo;
+}
+
+static void setpoint_read(const struct reg *reg, char *buf, size_t len)
+{
+  float tf;
+  tf=*setpoint(reg)/10000.0;
+  snprintf_P(buf,len,PSTR("%f"),(double)tf);
+  buf[len-1]=0;
+}
+
 static uint8_t eeprom_temperature_string_write(const struct reg *reg,
 					       const char *buf)
 {
@@ -157,7 +178,153 @@ static uint8_t eeprom_temperature_string_write(const struct reg *reg,
   s=reg_storage(reg);
   if (sscanf_P(buf,PSTR("%f"),&tf)!=1) return 1;
   t=(int32_t)(tf*10000.0);
-  eeprom_write_block(&t,(void *)s.loc.eeprom.start,4);
+  ee_update_block(&t,(void *)s.loc.eeprom.start,4);
+  return 0;
+}
+
+/* Calibration points: int16 hundredths of a degree */
+static void eeprom_cal_read(const struct reg *reg, char *buf, size_t len)
+{
+  struct storage s;
+  int16_t c;
+  s=reg_storage(reg);
+  c=ee_read_word((void *)s.loc.eeprom.start);
+  if (c==PROBE_CAL_UNSET) {
+    snprintf_P(buf,len,PSTR("None"));
+  } else {
+    snprintf_P(buf,len,PSTR("%f"),(double)(c/100.0));
+  }
+  buf[len-1]=0;
+}
+
+/* Read degrees, or "None" for PROBE_CAL_UNSET, as hundredths; returns
+   non-zero if buf isn't either */
+static uint8_t hundredths_scan(const char *buf, int16_t *c)
+{
+  float tf;
+  if (strcmp_P(buf,PSTR("None"))==0) {
+    *c=PROBE_CAL_UNSET;
+    return 0;
+  }
+  if (sscanf_P(buf,PSTR("%f"),&tf)!=1) return 1;
+  if (tf<-300.0 || tf>300.0) return 1;
+  *c=(int16_t)(tf*100.0+(tf<0?-0.5:0.5));
+  return 0;
+}
+
+static uint8_t eeprom_cal_write(const struct reg *reg, const char *buf)
+{
+  struct storage s;
+  int16_t c;
+  s=reg_storage(reg);
+  if (hundredths_scan(buf,&c)) return 1;
+  ee_update_word((void *)s.loc.eeprom.start,c);
+  probe_config_changed();
+  return 0;
+}
+
+/* Deadbands are only looked at by CHANGES, so the probes needn't be
+   set up again; "None" means any change counts */
+static uint8_t deadband_write(const struct reg *reg, const char *buf)
+{
+  struct storage s;
+  int16_t c;
+  s=reg_storage(reg);
+  if (hundredths_scan(buf,&c)) return 1;
+  if (c!=PROBE_CAL_UNSET && c<=0) return 1;
+  ee_update_word((void *)s.loc.eeprom.start,c);
+  return 0;
+}
+
+/* Mode set points: MODE_UNSET means leave the active one alone */
+static void mode_temperature_read(const struct reg *reg,
+				  char *buf, size_t len)
+{
+  struct storage s;
+  int32_t t;
+  s=reg_storage(reg);
+  ee_read_block(&t,(void *)s.loc.eeprom.start,4);
+  if (t==MODE_UNSET) {
+    snprintf_P(buf,len,PSTR("None"));
+    buf[len-1]=0;
+  } else {
+    eeprom_temperature_string_read(reg,buf,len);
+  }
+}
+
+static uint8_t mode_temperature_write(const struct reg *reg, const char *buf)
+{
+  struct storage s;
+  int32_t t=MODE_UNSET;
+  if (strcmp_P(buf,PSTR("None"))==0) {
+    s=reg_storage(reg);
+    ee_update_block(&t,(void *)s.loc.eeprom.start,4);
+    return 0;
+  }
+  return eeprom_temperature_string_write(reg,buf);
+}
+
+/* Settings are kept in RAM as well; see settings.h */
+static uint8_t setting_string_write(const struct reg *reg, const char *buf)
+{
+  if (eeprom_string_write(reg,buf)) return 1;
+  settings_changed();
+  return 0;
+}
+
+static uint8_t setting_uint8_write(const struct reg *reg, const char *buf)
+{
+  if (eeprom_uint8_write(reg,buf)) return 1;
+  settings_changed();
+  return 0;
+}
+
+static uint8_t setting_uint16_write(const struct reg *reg, const char *buf)
+{
+  if (eeprom_uint16_write(reg,buf)) return 1;
+  settings_changed();
+  return 0;
+}
+
+/* The control loops keep their configuration in RAM, so they must be
+   told when it changes.  Some of it is in the settings too. */
+static uint8_t control_temperature_write(const struct reg *reg,
+					 const char *buf)
+{
+  if (eeprom_temperature_string_write(reg,buf)) return 1;
+  settings_changed();
+  control_config_changed();
+  return 0;
+}
+
+static uint8_t control_uint8_write(const struct reg *reg, const char *buf)
+{
+  if (eeprom_uint8_write(reg,buf)) return 1;
+  settings_changed();
+  control_config_changed();
+  return 0;
+}
+
+static uint8_t control_uint16_write(const struct reg *reg, const char *buf)
+{
+  if (eeprom_uint16_write(reg,buf)) return 1;
+  control_config_changed();
+  return 0;
+}
+
+/* Writing 1 starts the profile from the beginning, 0 stops it.  It
+   won't start if step 0 is neither a hold nor a ramp. */
+static uint8_t profile_run_write(const struct reg *reg, const char *buf)
+{
+  (void)reg;
+  if (strcmp_P(buf,PSTR("1"))==0) {
+    profile_start();
+    if (profile_step==0xff) return 1;
+  } else if (strcmp_P(buf,PSTR("0"))==0) {
+    profile_stop();
+  } else {
+    return 1;
+  }
   return 0;
 }
 
@@ -203,10 +370,70 @@ static uint8_t error_counter_write(const struct reg *reg, const char *buf)
   return ok;
 }
 
+static void ram_uint8_read(const struct reg *reg, char *buf, size_t len)
+{
+  struct storage s;
+  s=reg_storage(reg);
+  snprintf_P(buf,len,PSTR("%" PRIu8),*(uint8_t *)s.loc.ram);
+}
+
+static void ram_uint32_read(const struct reg *reg, char *buf, size_t len)
+{
+  struct storage s;
+  uint32_t r;
+  s=reg_storage(reg);
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    r=*(uint32_t *)s.loc.ram;
+  }
+  snprintf_P(buf,len,PSTR("%" PRIu32),r);
+}
+
+static void ram_uint16_read(const struct reg *reg, char *buf, size_t len)
+{
+  struct storage s;
+  uint16_t r;
+  s=reg_storage(reg);
+  r=*(uint16_t *)s.loc.ram;
+  snprintf_P(buf,len,PSTR("%" PRIu16),r);
+}
+
+/* A uint16 in tenths of a second */
+static void ram_tenths_read(const struct reg *reg, char *buf, size_t len)
+{
+  struct storage s;
+  uint16_t r;
+  s=reg_storage(reg);
+  r=*(uint16_t *)s.loc.ram;
+  snprintf_P(buf,len,PSTR("%" PRIu16 ".%" PRIu16),r/10,r%10);
+}
+
+/* A 16-bit counter; writing decreases it, as for error counters */
+static uint8_t counter16_write(const struct reg *reg, const char *buf)
+{
+  struct storage s;
+  unsigned int dec;
+  uint8_t ok;
+  uint16_t *c;
+  s=reg_storage(reg);
+  c=(uint16_t *)s.loc.ram;
+  if (sscanf_P(buf,PSTR("%u"),&dec)!=1) return 1;
+  ok=0;
+  ATOMIC_BLOCK(ATOMIC_FORCEON) {
+    if (dec>*c) {
+      ok=1;
+    } else {
+      *c-=dec;
+    }
+  }
+  return ok;
+}
+
+/* The pin is the control loop number */
 static void valve_state_read(const struct reg *reg, char *buf, size_t len)
 {
-  (void)reg;
-  switch (get_valve_state()) {
+  struct storage s;
+  s=reg_storage(reg);
+  switch (get_valve_state(s.loc.pin)) {
   case VALVE_CLOSED:
     strncpy_P(buf,PSTR("Closed"),len);
     break;
@@ -219,6 +446,9 @@ static void valve_state_read(const struct reg *reg, char *buf, size_t len)
   case VALVE_CLOSING:
     strncpy_P(buf,PSTR("Closing"),len);
     break;
+  case VALVE_NONE:
+    strncpy_P(buf,PSTR("None"),len);
+    break;
   default:
     strncpy_P(buf,PSTR("Error"),len);
     break;
@@ -242,7 +472,16 @@ const struct reg ident={
   .storage.loc.eeprom={0x03f4,0x08},
   .storage.slen=9,
   .readstr=eeprom_string_read,
-  .writestr=eeprom_string_write,
+  .writestr=setting_string_write,
+};
+
+const struct reg busaddr={
+  .name="addr",
+  .description="Bus address",
+  .storage.loc.eeprom={0x3e1,0x01},
+  .storage.slen=4,
+  .readstr=eeprom_uint8_read,
+  .writestr=setting_uint8_write,
 };
 
 const struct reg fpsetup={
@@ -251,7 +490,7 @@ const struct reg fpsetup={
   .storage.loc.eeprom={0x3f0,0x01},
   .storage.slen=4,
   .readstr=eeprom_uint8_read,
-  .writestr=eeprom_uint8_write,
+  .writestr=setting_uint8_write,
 };
 
 const struct reg vtype={
@@ -260,7 +499,7 @@ const struct reg vtype={
   .storage.loc.eeprom={0x3f1,0x01},
   .storage.slen=4,
   .readstr=eeprom_uint8_read,
-  .writestr=eeprom_uint8_write,
+  .writestr=control_uint8_write,
 };
 
 const struct reg bl={
@@ -269,7 +508,7 @@ const struct reg bl={
   .storage.loc.eeprom={0x3f2,0x02},
   .storage.slen=6,
   .readstr=eeprom_uint16_read,
-  .writestr=eeprom_uint16_write,
+  .writestr=setting_uint16_write,
 };
 
 const struct reg blalarm={
@@ -278,7 +517,7 @@ const struct reg blalarm={
   .storage.loc.eeprom={0x3e0,0x01},
   .storage.slen=4,
   .readstr=eeprom_uint8_read,
-  .writestr=eeprom_uint8_write,
+  .writestr=setting_uint8_write,
 };
 
 const struct reg jog_flip={
@@ -287,7 +526,7 @@ const struct reg jog_flip={
   .storage.loc.eeprom={0x3e2,0x02},
   .storage.slen=6,
   .readstr=eeprom_uint16_read,
-  .writestr=eeprom_uint16_write,
+  .writestr=setting_uint16_write,
 };
 
 const struct reg jog_wait={
@@ -296,7 +535,36 @@ const struct reg jog_wait={
   .storage.loc.eeprom={0x3e4,0x02},
   .storage.slen=6,
   .readstr=eeprom_uint16_read,
-  .writestr=eeprom_uint16_write,
+  .writestr=setting_uint16_write,
+};
+
+static uint8_t relay_ms_write(const struct reg *reg, const char *buf)
+{
+  if (eeprom_uint8_write(reg,buf)) return 1;
+  relay_load_config();
+  return 0;
+}
+
+static const struct reg relay_pulse={
+  .name="relay/ms",
+  .description="Relay pulse time",
+  .storage.loc.eeprom={RELAY_PULSE_EEPROM,0x01},
+  .storage.slen=4,
+  .readstr=eeprom_uint8_read,
+  .writestr=relay_ms_write,
+};
+
+static void pending_read(const struct reg *reg, char *buf, size_t len)
+{
+  (void)reg;
+  snprintf_P(buf,len,PSTR("%" PRIu8),ee_pending());
+}
+
+static const struct reg pending={
+  .name="pending",
+  .description="Eeprom bytes due",
+  .storage.slen=4,
+  .readstr=pending_read,
 };
 
 static const struct reg version={
@@ -315,43 +583,163 @@ static const struct reg alarmreg={
   .readstr=alarm_string_read,
 };
 
-#define proberegs(probe,addr)			\
-  static const struct reg probe={		\
-    .name=#probe,				\
-    .description=#probe " probe reading",	\
-    .storage.loc.ram=&probe##_temp,		\
+/* Probe configuration is cached in RAM by the probe reader, so it
+   must be told when it changes */
+static uint8_t probe_addr_write(const struct reg *reg, const char *buf)
+{
+  if (owb_addr_write(reg,buf)) return 1;
+  probe_config_changed();
+  return 0;
+}
+
+static uint8_t probe_uint8_write(const struct reg *reg, const char *buf)
+{
+  if (eeprom_uint8_write(reg,buf)) return 1;
+  probe_config_changed();
+  return 0;
+}
+
+/* Registers are generated for each of the PROBES probes; PROBES_N(n,X)
+   expands X(0) ... X(n-1) */
+#define PROBES_1(X) X(0)
+#define PROBES_2(X) PROBES_1(X) X(1)
+#define PROBES_3(X) PROBES_2(X) X(2)
+#define PROBES_4(X) PROBES_3(X) X(3)
+#define PROBES_5(X) PROBES_4(X) X(4)
+#define PROBES_6(X) PROBES_5(X) X(5)
+#define PROBES_7(X) PROBES_6(X) X(6)
+#define PROBES_8(X) PROBES_7(X) X(7)
+#define PROBES_9(X) PROBES_8(X) X(8)
+#define PROBES_10(X) PROBES_9(X) X(9)
+#define PROBES_11(X) PROBES_10(X) X(10)
+#define PROBES_12(X) PROBES_11(X) X(11)
+#define PROBES_N_(n,X) PROBES_##n(X)
+#define PROBES_N(n,X) PROBES_N_(n,X)
+#define FOR_EACH_PROBE(X) PROBES_N(PROBES,X)
+
+#define proberegs(n)				\
+  static const struct reg t##n={		\
+    .name="t" #n,				\
+    .description="Filtered reading",		\
+    .storage.loc.ram=&probes[n].temp,		\
     .storage.slen=12,				\
     .readstr=temperature_string_read,		\
   };						\
-  static const struct reg probe##_id={		\
-    .name=#probe "/id",				\
-    .description=#probe " probe address",	\
-    .storage.loc.eeprom={addr,0x08},		\
+  static const struct reg t##n##_raw={		\
+    .name="t" #n "/raw",			\
+    .description="Raw reading",		\
+    .storage.loc.ram=&probes[n].raw,		\
+    .storage.slen=12,				\
+    .readstr=temperature_string_read,		\
+  };						\
+  static const struct reg t##n##_id={		\
+    .name="t" #n "/id",				\
+    .description="Probe address",		\
+    .storage.loc.eeprom={PROBE_EEPROM(n)+PROBE_ID,0x08}, \
     .storage.slen=17,				\
     .readstr=owb_addr_read,			\
-    .writestr=owb_addr_write,			\
+    .writestr=probe_addr_write,			\
+  };						\
+  static const struct reg t##n##_c0={		\
+    .name="t" #n "/c0",				\
+    .description="Cal point 0",			\
+    .storage.loc.eeprom={PROBE_EEPROM(n)+PROBE_C0,0x02}, \
+    .storage.slen=12,				\
+    .readstr=eeprom_cal_read,			\
+    .writestr=eeprom_cal_write,			\
+  };						\
+  static const struct reg t##n##_c0r={		\
+    .name="t" #n "/c0r",			\
+    .description="Reading at c0",		\
+    .storage.loc.eeprom={PROBE_EEPROM(n)+PROBE_C0R,0x02}, \
+    .storage.slen=12,				\
+    .readstr=eeprom_cal_read,			\
+    .writestr=eeprom_cal_write,			\
+  };						\
+  static const struct reg t##n##_c1={		\
+    .name="t" #n "/c1",				\
+    .description="Cal point 1",			\
+    .storage.loc.eeprom={PROBE_EEPROM(n)+PROBE_C1,0x02}, \
+    .storage.slen=12,				\
+    .readstr=eeprom_cal_read,			\
+    .writestr=eeprom_cal_write,			\
   };						\
-  static const struct reg probe##_c0={		\
-    .name=#probe "/c0",				\
-    .description=#probe " cal point 0",		\
-    .storage.loc.eeprom={addr+0x8,0x02},	\
-    .storage.slen=6,				\
-    .readstr=eeprom_uint16_read,		\
-    .writestr=eeprom_uint16_write,		\
+  static const struct reg t##n##_c1r={		\
+    .name="t" #n "/c1r",			\
+    .description="Reading at c1",		\
+    .storage.loc.eeprom={PROBE_EEPROM(n)+PROBE_C1R,0x02}, \
+    .storage.slen=12,				\
+    .readstr=eeprom_cal_read,			\
+    .writestr=eeprom_cal_write,			\
+  };						\
+  static const struct reg t##n##_res={		\
+    .name="t" #n "/res",			\
+    .description="Resolution",			\
+    .storage.loc.eeprom={PROBE_CONFIG(n)+PROBE_RES,0x01}, \
+    .storage.slen=4,				\
+    .readstr=eeprom_uint8_read,			\
+    .writestr=probe_uint8_write,		\
+  };						\
+  static const struct reg t##n##_per={		\
+    .name="t" #n "/per",			\
+    .description="Read period",			\
+    .storage.loc.eeprom={PROBE_CONFIG(n)+PROBE_PERIOD,0x01}, \
+    .storage.slen=4,				\
+    .readstr=eeprom_uint8_read,			\
+    .writestr=probe_uint8_write,		\
+  };						\
+  static const struct reg t##n##_filt={		\
+    .name="t" #n "/filt",			\
+    .description="Filter type",			\
+    .storage.loc.eeprom={PROBE_CONFIG(n)+PROBE_FILTER,0x01}, \
+    .storage.slen=4,				\
+    .readstr=eeprom_uint8_read,			\
+    .writestr=probe_uint8_write,		\
+  };						\
+  static const struct reg t##n##_ema={		\
+    .name="t" #n "/ema",			\
+    .description="Average shift",		\
+    .storage.loc.eeprom={PROBE_CONFIG(n)+PROBE_SHIFT,0x01}, \
+    .storage.slen=4,				\
+    .readstr=eeprom_uint8_read,			\
+    .writestr=probe_uint8_write,		\
   };						\
-  static const struct reg probe##_c0r={		\
-    .name=#probe "/c0r",			\
-    .description=#probe " reading at c0",	\
-    .storage.loc.eeprom={addr+0xa,0x02},	\
-    .storage.slen=6,				\
-    .readstr=eeprom_uint16_read,		\
-    .writestr=eeprom_uint16_write,		\
+  static const struct reg t##n##_fail={		\
+    .name="t" #n "/fail",			\
+    .description="Failed reads",		\
+    .storage.loc.ram=&probes[n].failures,	\
+    .storage.slen=4,				\
+    .readstr=error_counter_read,		\
+  };
+
+#define proberefs(n)							\
+  &t##n,&t##n##_raw,&t##n##_id,&t##n##_c0,&t##n##_c0r,&t##n##_c1,	\
+    &t##n##_c1r,&t##n##_res,&t##n##_per,&t##n##_filt,&t##n##_ema,	\
+    &t##n##_fail,
+
+FOR_EACH_PROBE(proberegs)
+
+/* How far a probe reading must move before CHANGES reports it */
+#define deadbandreg(n)					\
+  static const struct reg t##n##_db={			\
+    .name="t" #n "/db",					\
+    .description="Report deadband",			\
+    .storage.loc.eeprom={PROBE_DEADBAND(n),0x02},	\
+    .storage.slen=12,					\
+    .readstr=eeprom_cal_read,				\
+    .writestr=deadband_write,				\
   };
+#define deadbandref(n) &t##n##_db,
 
-proberegs(t0,0x010);
-proberegs(t1,0x020);
-proberegs(t2,0x030);
-proberegs(t3,0x040);
+FOR_EACH_PROBE(deadbandreg)
+
+static const struct reg alarm_probes={
+  .name="alarm/pr",
+  .description="Probes in alarm",
+  .storage.loc.ram=&probe_alarms,
+  .storage.slen=6,
+  .readstr=ram_uint16_read,
+};
 
 const struct reg v0={
   .name="v0",
@@ -360,21 +748,201 @@ const struct reg v0={
   .storage.slen=8,
   .readstr=valve_state_read,
 };
+static const struct reg v1={
+  .name="v1",
+  .description="Loop 1 valve",
+  .storage.loc.pin=1,
+  .storage.slen=8,
+  .readstr=valve_state_read,
+};
+static const struct reg v0_act={
+  .name="v0/act",
+  .description="Valve 0 moves",
+  .storage.loc.ram=&loops[0].moves,
+  .storage.slen=6,
+  .readstr=ram_uint16_read,
+  .writestr=counter16_write,
+};
+static const struct reg v1_act={
+  .name="v1/act",
+  .description="Valve 1 moves",
+  .storage.loc.ram=&loops[1].moves,
+  .storage.slen=6,
+  .readstr=ram_uint16_read,
+  .writestr=counter16_write,
+};
+#define valvestats(n)					\
+  static const struct reg r##n##_act={			\
+    .name="r" #n "/act",				\
+    .description="Relay operations",			\
+    .storage.loc.ram=&relay_actuations[n],		\
+    .storage.slen=11,					\
+    .readstr=ram_uint32_read,				\
+  };							\
+  static const struct reg v##n##_open={			\
+    .name="v" #n "/open",				\
+    .description="Seconds open",			\
+    .storage.loc.ram=&loops[n].open_secs,		\
+    .storage.slen=11,					\
+    .readstr=ram_uint32_read,				\
+  };							\
+  static const struct reg v##n##_duty={			\
+    .name="v" #n "/duty",				\
+    .description="Open per mille",			\
+    .storage.loc.ram=&loops[n].duty,			\
+    .storage.slen=6,					\
+    .readstr=ram_uint16_read,				\
+  };							\
+  static const struct reg v##n##_tto={			\
+    .name="v" #n "/tto",				\
+    .description="Opening time",			\
+    .storage.loc.ram=&loops[n].travel_open,		\
+    .storage.slen=8,					\
+    .readstr=ram_tenths_read,				\
+  };							\
+  static const struct reg v##n##_ttc={			\
+    .name="v" #n "/ttc",				\
+    .description="Closing time",			\
+    .storage.loc.ram=&loops[n].travel_close,		\
+    .storage.slen=8,					\
+    .readstr=ram_tenths_read,				\
+  };
+#define valvestatrefs(n) &r##n##_act,&v##n##_open,&v##n##_duty,	\
+    &v##n##_tto,&v##n##_ttc
+valvestats(0)
+valvestats(1)
+static const struct reg duty_win={
+  .name="duty/win",
+  .description="Duty window mins",
+  .storage.loc.eeprom={DUTY_WINDOW_EEPROM,0x01},
+  .storage.slen=4,
+  .readstr=eeprom_uint8_read,
+  .writestr=control_uint8_write,
+};
+static const struct reg pid_mode={
+  .name="pid/mode",
+  .description="Control mode",
+  .storage.loc.eeprom={PID_EEPROM+PID_MODE,0x01},
+  .storage.slen=4,
+  .readstr=eeprom_uint8_read,
+  .writestr=control_uint8_write,
+};
+#define pidreg(n,desc,field)				\
+  static const struct reg pid_##n={			\
+    .name="pid/" #n,					\
+    .description=desc,					\
+    .storage.loc.eeprom={PID_EEPROM+field,0x02},	\
+    .storage.slen=6,					\
+    .readstr=eeprom_uint16_read,			\
+    .writestr=control_uint16_write,			\
+  };
+pidreg(kp,"Proportion gain",PID_KP)
+pidreg(ki,"Integral gain",PID_KI)
+pidreg(kd,"Derivative gain",PID_KD)
+pidreg(cyc,"Cycle time",PID_CYCLE)
+pidreg(min,"Min on/off time",PID_MIN)
+static const struct reg pid_out={
+  .name="pid/out",
+  .description="Duty per mille",
+  .storage.loc.ram=&loops[0].pid_duty,
+  .storage.slen=6,
+  .readstr=ram_uint16_read,
+};
+static const struct reg prof_run={
+  .name="prof/run",
+  .description="Profile running",
+  .storage.loc.eeprom={PROFILE_STATE+PROFILE_RUN,0x01},
+  .storage.slen=4,
+  .readstr=eeprom_uint8_read,
+  .writestr=profile_run_write,
+};
+static const struct reg prof_step={
+  .name="prof/st",
+  .description="Profile step",
+  .storage.loc.ram=&profile_step,
+  .storage.slen=4,
+  .readstr=ram_uint8_read,
+};
+static const struct reg prof_left={
+  .name="prof/rem",
+  .description="Step secs left",
+  .storage.loc.ram=&profile_left,
+  .storage.slen=11,
+  .readstr=ram_uint32_read,
+};
+#define stepregs(n)					\
+  static const struct reg p##n##_type={			\
+    .name="p" #n "/type",				\
+    .description="Step type",				\
+    .storage.loc.eeprom={PROFILE_STEP(n)+STEP_TYPE,0x01}, \
+    .storage.slen=4,					\
+    .readstr=eeprom_uint8_read,				\
+    .writestr=eeprom_uint8_write,			\
+  };							\
+  static const struct reg p##n##_temp={			\
+    .name="p" #n "/temp",				\
+    .description="Step temperature",			\
+    .storage.loc.eeprom={PROFILE_STEP(n)+STEP_TEMP,0x04}, \
+    .storage.slen=12,					\
+    .readstr=eeprom_temperature_string_read,		\
+    .writestr=eeprom_temperature_string_write,		\
+  };							\
+  static const struct reg p##n##_time={			\
+    .name="p" #n "/time",				\
+    .description="Step minutes",			\
+    .storage.loc.eeprom={PROFILE_STEP(n)+STEP_TIME,0x02}, \
+    .storage.slen=6,					\
+    .readstr=eeprom_uint16_read,			\
+    .writestr=eeprom_uint16_write,			\
+  };
+#define steprefs(n) &p##n##_type,&p##n##_temp,&p##n##_time
+stepregs(0)
+stepregs(1)
+stepregs(2)
+stepregs(3)
+stepregs(4)
+stepregs(5)
+stepregs(6)
+stepregs(7)
+static const struct reg l1_probe={
+  .name="l1/probe",
+  .description="Loop 1 probe",
+  .storage.loc.eeprom={LOOP_EEPROM(1)+LOOP_PROBE,0x01},
+  .storage.slen=4,
+  .readstr=eeprom_uint8_read,
+  .writestr=control_uint8_write,
+};
+static const struct reg l1_hi={
+  .name="l1/hi",
+  .description="Loop 1 upper set",
+  .storage.loc.eeprom={LOOP_EEPROM(1)+LOOP_SET_HI,0x04},
+  .storage.slen=12,
+  .readstr=eeprom_temperature_string_read,
+  .writestr=control_temperature_write,
+};
+static const struct reg l1_lo={
+  .name="l1/lo",
+  .description="Loop 1 lower set",
+  .storage.loc.eeprom={LOOP_EEPROM(1)+LOOP_SET_LO,0x04},
+  .storage.slen=12,
+  .readstr=eeprom_temperature_string_read,
+  .writestr=control_temperature_write,
+};
 const struct reg set_hi={
   .name="set/hi",
   .description="Upper set point",
   .storage.loc.eeprom={0x050,0x04},
   .storage.slen=12,
-  .readstr=eeprom_temperature_string_read,
-  .writestr=eeprom_temperature_string_write,
+  .readstr=setpoint_read,
+  .writestr=control_temperature_write,
 };
 const struct reg set_lo={
   .name="set/lo",
   .description="Lower set point",
   .storage.loc.eeprom={0x054,0x04},
   .storage.slen=12,
-  .readstr=eeprom_temperature_string_read,
-  .writestr=eeprom_temperature_string_write,
+  .readstr=setpoint_read,
+  .writestr=control_temperature_write,
 };
 const struct reg mode={
   .name="mode",
@@ -382,7 +950,7 @@ const struct reg mode={
   .storage.loc.eeprom={0x058,0x08},
   .storage.slen=9,
   .readstr=eeprom_string_read,
-  .writestr=eeprom_string_write,
+  .writestr=setting_string_write,
 };
 const struct reg alarm_hi={
   .name="alarm/hi",
@@ -390,7 +958,7 @@ const struct reg alarm_hi={
   .storage.loc.eeprom={0x3d0,0x04},
   .storage.slen=12,
   .readstr=eeprom_temperature_string_read,
-  .writestr=eeprom_temperature_string_write,
+  .writestr=control_temperature_write,
 };
 const struct reg alarm_lo={
   .name="alarm/lo",
@@ -398,7 +966,7 @@ const struct reg alarm_lo={
   .storage.loc.eeprom={0x3d4,0x04},
   .storage.slen=12,
   .readstr=eeprom_temperature_string_read,
-  .writestr=eeprom_temperature_string_write,
+  .writestr=control_temperature_write,
 };
 const struct reg jog_hi={
   .name="jog/hi",
@@ -406,7 +974,7 @@ const struct reg jog_hi={
   .storage.loc.eeprom={0x3d8,0x04},
   .storage.slen=12,
   .readstr=eeprom_temperature_string_read,
-  .writestr=eeprom_temperature_string_write,
+  .writestr=control_temperature_write,
 };
 const struct reg jog_lo={
   .name="jog/lo",
@@ -414,77 +982,45 @@ const struct reg jog_lo={
   .storage.loc.eeprom={0x3dc,0x04},
   .storage.slen=12,
   .readstr=eeprom_temperature_string_read,
-  .writestr=eeprom_temperature_string_write,
+  .writestr=control_temperature_write,
 };
 
-#define moderegs(mode,addr1,addr2)			\
+#define modetemp(mode,n,suffix,id,desc,field)	\
+  static const struct reg mode##_##id={			\
+    .name=#mode "/" suffix,				\
+    .description="Mode " #n " " desc,			\
+    .storage.loc.eeprom={MODE_EEPROM(n)+field,0x04},	\
+    .storage.slen=12,					\
+    .readstr=mode_temperature_read,			\
+    .writestr=mode_temperature_write,			\
+  };
+
+#define moderegs(mode,n)				\
   static const struct reg mode##_name={		\
     .name=#mode "/name",			\
-    .description="Mode " #mode " name",		\
-    .storage.loc.eeprom={addr1,0x08},		\
+    .description="Mode " #n " name",		\
+    .storage.loc.eeprom={MODE_EEPROM(n)+MODE_NAME,0x08}, \
     .storage.slen=9,				\
     .readstr=eeprom_string_read,		\
     .writestr=eeprom_string_write,		\
   };						\
-  static const struct reg mode##_lo={		\
-    .name=#mode "/lo",				\
-    .description="Mode " #mode " low set",	\
-    .storage.loc.eeprom={addr1+8,0x04},		\
-    .storage.slen=5,				\
-    .readstr=eeprom_string_read,		\
-    .writestr=eeprom_string_write,		\
-  };						\
-  static const struct reg mode##_hi={		\
-    .name=#mode "/hi",				\
-    .description="Mode " #mode " hi set",	\
-    .storage.loc.eeprom={addr1+12,0x04},	\
-    .storage.slen=5,				\
-    .readstr=eeprom_string_read,		\
-    .writestr=eeprom_string_write,		\
-  };						\
-  static const struct reg mode##_alarm_lo={	\
-    .name=#mode "/a/lo",			\
-    .description="Mode " #mode "alarm lo",	\
-    .storage.loc.eeprom={addr2+0,0x04},		\
-    .storage.slen=5,				\
-    .readstr=eeprom_string_read,		\
-    .writestr=eeprom_string_write,		\
-  };						\
-  static const struct reg mode##_alarm_hi={	\
-    .name=#mode "/a/hi",			\
-    .description="Mode " #mode "alarm hi",	\
-    .storage.loc.eeprom={addr2+4,0x04},		\
-    .storage.slen=5,				\
-    .readstr=eeprom_string_read,		\
-    .writestr=eeprom_string_write,		\
-  };						\
-  static const struct reg mode##_jog_lo={	\
-    .name=#mode "/j/lo",			\
-    .description="Mode " #mode "jog lo",	\
-    .storage.loc.eeprom={addr2+8,0x04},		\
-    .storage.slen=5,				\
-    .readstr=eeprom_string_read,		\
-    .writestr=eeprom_string_write,		\
-  };						\
-  static const struct reg mode##_jog_hi={	\
-    .name=#mode "/j/hi",			\
-    .description="Mode " #mode " jog hi",	\
-    .storage.loc.eeprom={addr2+12,0x04},	\
-    .storage.slen=5,				\
-    .readstr=eeprom_string_read,		\
-    .writestr=eeprom_string_write,		\
-  };
+  modetemp(mode,n,"lo",lo,"low set",MODE_LO)		\
+  modetemp(mode,n,"hi",hi,"hi set",MODE_HI)		\
+  modetemp(mode,n,"a/lo",alarm_lo,"alarm lo",MODE_ALARM_LO) \
+  modetemp(mode,n,"a/hi",alarm_hi,"alarm hi",MODE_ALARM_HI) \
+  modetemp(mode,n,"j/lo",jog_lo,"jog lo",MODE_JOG_LO)	\
+  modetemp(mode,n,"j/hi",jog_hi,"jog hi",MODE_JOG_HI)
 
 #define moderegrefs(mode)						\
   &mode##_name,&mode##_lo,&mode##_hi,&mode##_alarm_lo,&mode##_alarm_hi, \
     &mode##_jog_lo,&mode##_jog_hi
 
-moderegs(m0,0x060,0x160);
-moderegs(m1,0x070,0x170);
-moderegs(m2,0x080,0x180);
-moderegs(m3,0x090,0x190);
-moderegs(m4,0x0a0,0x1a0);
-moderegs(m5,0x0b0,0x1b0);
+moderegs(m0,0)
+moderegs(m1,1)
+moderegs(m2,2)
+moderegs(m3,3)
+moderegs(m4,4)
+moderegs(m5,5)
 
 static const struct reg err_miss={
   .name="err/miss",
@@ -518,25 +1054,56 @@ static const struct reg err_pwr={
   .readstr=error_counter_read,
   .writestr=error_counter_write,
 };
+static const struct reg err_cfg={
+  .name="err/cfg",
+  .description="Settings CRC bad",
+  .storage.loc.ram=&settings_crc_errors,
+  .storage.slen=4,
+  .readstr=error_counter_read,
+  .writestr=error_counter_write,
+};
 
+static const struct reg err_rxov={
+  .name="err/rxov",
+  .description="Commands lost",
+  .storage.loc.ram=&rx_overflows,
+  .storage.slen=4,
+  .readstr=error_counter_read,
+  .writestr=error_counter_write,
+};
+
+/* Binary frames refer to registers by their place in this list, so new
+   ones go at the end */
 static const PROGMEM struct reg *const all_registers[]={
   &ident, &flashcount, &version, &bl, &blalarm, &alarmreg, &fpsetup,
-  &jog_flip, &jog_wait,
-  &t0,&t0_id,&t0_c0,&t0_c0r,
-  &t1,&t1_id,&t1_c0,&t1_c0r,
-  &t2,&t2_id,&t2_c0,&t2_c0r,
-  &t3,&t3_id,&t3_c0,&t3_c0r,
+  &jog_flip, &jog_wait, &relay_pulse, &pending,
+  FOR_EACH_PROBE(proberefs)
   &v0,&vtype,
-  &set_hi,&set_lo,&mode,&alarm_hi,&alarm_lo,&jog_hi,&jog_lo,
+  &set_hi,&set_lo,&mode,&alarm_hi,&alarm_lo,&alarm_probes,&jog_hi,&jog_lo,
+  &v0_act,&pid_mode,&pid_kp,&pid_ki,&pid_kd,&pid_cyc,&pid_min,&pid_out,
+  &v1,&v1_act,&l1_probe,&l1_hi,&l1_lo,
+  valvestatrefs(0),valvestatrefs(1),&duty_win,
+  &prof_run,&prof_step,&prof_left,
+  steprefs(0),steprefs(1),steprefs(2),steprefs(3),
+  steprefs(4),steprefs(5),steprefs(6),steprefs(7),
   moderegrefs(m0),
   moderegrefs(m1),
   moderegrefs(m2),
   moderegrefs(m3),
   moderegrefs(m4),
   moderegrefs(m5),
-  &err_miss,&err_shrt,&err_crc,&err_pwr,
+  &err_miss,&err_shrt,&err_crc,&err_pwr,&err_cfg,
+  &busaddr,
+  FOR_EACH_PROBE(deadbandref)
+  &err_rxov,
 };
 
+#define REGISTERS (sizeof(all_registers)/sizeof(all_registers[0]))
+typedef char changes_registers_too_small[REGISTERS<=CHANGES_REGISTERS?1:-1];
+/* Registers are numbered with a uint8_t, and lookups stop at the first
+   number past the end, so there can be no more than 255 */
+typedef char too_many_registers[REGISTERS<=255?1:-1];
+
 const struct reg *reg_number(uint8_t n)
 {
   const struct reg *rv;
@@ -608,6 +1175,111 @@ uint8_t reg_write_string(const struct reg *reg, const char *buf)
     return 1;
 }
 
+uint8_t reg_writable(const struct reg *reg)
+{
+  writestr_fn writestr;
+  memcpy_P(&writestr,&reg->writestr,sizeof(writestr_fn));
+  return writestr!=NULL;
+}
+
+/* How the readstr functions' registers are stored, for reg_read_raw();
+   RAM registers are 1, 2 or 4 bytes */
+#define RAW_EEPROM 0
+#define RAW_VALVE 3 /* The pin is a control loop number */
+#define RAW_SETPOINT 5 /* See setpoint_read() */
+static const struct {
+  readstr_fn readstr;
+  uint8_t kind;
+} raw_kinds[] PROGMEM={
+  {eeprom_string_read,RAW_EEPROM},
+  {eeprom_uint32_read_bigendian,RAW_EEPROM},
+  {eeprom_uint16_read,RAW_EEPROM},
+  {eeprom_uint8_read,RAW_EEPROM},
+  {owb_addr_read,RAW_EEPROM},
+  {eeprom_temperature_string_read,RAW_EEPROM},
+  {setpoint_read,RAW_SETPOINT},
+  {eeprom_cal_read,RAW_EEPROM},
+  {mode_temperature_read,RAW_EEPROM},
+  {temperature_string_read,4},
+  {error_counter_read,1},
+  {ram_uint8_read,1},
+  {ram_uint16_read,2},
+  {ram_tenths_read,2},
+  {ram_uint32_read,4},
+  {valve_state_read,RAW_VALVE},
+};
+
+#define RAW_NONE 0xff
+static uint8_t raw_kind(const struct reg *reg)
+{
+  readstr_fn readstr,r;
+  uint8_t i;
+  memcpy_P(&readstr,&reg->readstr,sizeof(readstr_fn));
+  for (i=0; i<sizeof(raw_kinds)/sizeof(raw_kinds[0]); i++) {
+    memcpy_P(&r,&raw_kinds[i].readstr,sizeof(readstr_fn));
+    if (r==readstr) return pgm_read_byte(&raw_kinds[i].kind);
+  }
+  return RAW_NONE;
+}
+
+uint8_t reg_raw_length(const struct reg *reg)
+{
+  uint8_t kind;
+  kind=raw_kind(reg);
+  switch (kind) {
+  case RAW_NONE:
+    return 0;
+  case RAW_EEPROM:
+    return reg_storage(reg).loc.eeprom.length;
+  case RAW_VALVE:
+    return 1;
+  case RAW_SETPOINT:
+    return 4;
+  default:
+    return kind;
+  }
+}
+
+uint8_t reg_read_raw(const struct reg *reg, uint8_t *buf)
+{
+  struct storage s;
+  uint8_t kind;
+  kind=raw_kind(reg);
+  s=reg_storage(reg);
+  switch (kind) {
+  case RAW_NONE:
+    return 0;
+  case RAW_EEPROM:
+    ee_read_block(buf,(void *)s.loc.eeprom.start,s.loc.eeprom.length);
+    return s.loc.eeprom.length;
+  case RAW_VALVE:
+    buf[0]=get_valve_state(s.loc.pin);
+    return 1;
+  case RAW_SETPOINT:
+    memcpy(buf,setpoint(reg),4);
+    return 4;
+  default:
+    ATOMIC_BLOCK(ATOMIC_FORCEON) {
+      memcpy(buf,s.loc.ram,kind);
+    }
+    return kind;
+  }
+}
+
+int8_t reg_probe(const struct reg *reg)
+{
+  readstr_fn readstr;
+  struct storage s;
+  uint8_t n;
+  memcpy_P(&readstr,&reg->readstr,sizeof(readstr_fn));
+  if (readstr!=temperature_string_read) return -1;
+  s=reg_storage(reg);
+  for (n=0; n<PROBES; n++) {
+    if (s.loc.ram==&probes[n].temp) return n;
+  }
+  return -1;
+}
+
 void record_error(uint8_t *err)
 {
   if (*err<0xff) (*err)++;
@@ -38,11 +38,21 @@ extern struct storage reg_storage(const struct reg *reg);
 extern void reg_read_string(const struct reg *reg, char *buf, size_t len);
 /* Returns 0 for success, non-zero for failure */
 extern uint8_t reg_write_string(const struct reg *reg, const char *buf);
+extern uint8_t reg_writable(const struct reg *reg);
+/* Read a register's value as the bytes it is stored as, little-endian,
+   into buf of at least REG_RAW_MAX bytes.  Returns the number of bytes,
+   or 0 if it has no raw form (eg. version). */
+#define REG_RAW_MAX 8
+extern uint8_t reg_read_raw(const struct reg *reg, uint8_t *buf);
+/* The number of bytes reg_read_raw() will return, without reading */
+extern uint8_t reg_raw_length(const struct reg *reg);
+/* The probe whose filtered reading reg is, or -1 */
+extern int8_t reg_probe(const struct reg *reg);
 
 extern void record_error(uint8_t *err);
 
 /* Registers accessed by name in the code */
 extern const struct reg ident,bl,blalarm,set_hi,set_lo,mode,alarm_hi,alarm_lo,
-  jog_hi,jog_lo,vtype,fpsetup,jog_flip,jog_wait;
+  jog_hi,jog_lo,vtype,fpsetup,jog_flip,jog_wait,busaddr;
 
 #endif /* _registers_h */
@@ -10,14 +10,33 @@
    selected then we MUST NOT transmit (and may produce debug output).
    If we are selected while sending debug output, we stop immediately.
 
-   Commands are received over the RS485 bus one line at a time.  They
+   Commands are received over the RS485 bus one line at a time, or as
+   binary frames (see frame.h) which end after the length they give
+   rather than at a '\n'.  Empty lines are ignored.  Commands
    are executed on reception of the terminating '\n' by the main loop
-   (i.e. interrupts on).  If we receive bytes while executing a
-   command, we discard them.  If there's a buffer overflow, the
-   receive buffer is discarded and we wait for the next '\n' before
-   starting to receive again (and increase the appropriate error
-   counter).  Reception into the receive buffer always starts at index
-   0.
+   (i.e. interrupts on).  Each is received into one of SERIAL_RX_SLOTS
+   buffers, so that the next can arrive while one is being executed;
+   the head end may send that many commands without waiting for the
+   replies.  If a line is too long or there is no free buffer, it is
+   discarded, rx_overflows is increased, and we wait for the next '\n'
+   before starting to receive again.
+
+   If the addr register is set, the bus uses 9-bit characters instead,
+   and a station is selected by sending its address as a character with
+   the ninth bit set.  The UART's multi-processor mode then ignores
+   everything sent to other stations, so we don't even take an
+   interrupt for it.  Address SERIAL_BROADCAST makes every station
+   listen and none transmit, for BAUD and the like.  An address takes
+   a receive buffer in turn with the lines, so that the main loop
+   deals with everything in the order it arrived.
+
+   A station that has just been deselected keeps driving the bus for
+   100us, timed by Timer0, so that there is always a transmitter on.
+
+   POLLALL has every station with an address reply without being
+   selected, each in its own slot after the end of the command.  The
+   reply waits in the transmit buffer while Timer0 counts down to the
+   slot, then we drive the bus just until it has gone.
 
    The transmit buffer is a ring.  It is written into using printf()
    and friends through stdout.  This blocks if the buffer is full.
@@ -33,12 +52,24 @@
 #include "config.h"
 #include "registers.h"
 #include "hardware.h"
+#include "settings.h"
+#include "frame.h"
+#include "timer.h"
 
-/* Receive buffer.  rxptr is the offset in buffer for the next
-   received byte; 0xfe means "disabled until next '\n'", and 0xff
-   means "disabled until command processing is done" */
-static uint8_t rxptr;
-char rxbuf[SERIAL_RX_BUFSIZE];
+/* Receive buffers.  Bytes go into slot rx_in at offset rxptr; 0xfe
+   means "disabled until next '\n'".  rx_waiting complete lines wait in
+   the slots from rx_out on, and rxbuf is slot rx_out, the one the main
+   loop works on.  rx_kind says whether each slot holds a line (0) or
+   an address (SERIAL_ADDRESS_*). */
+static char rxslots[SERIAL_RX_SLOTS][SERIAL_RX_BUFSIZE];
+static uint8_t rx_kind[SERIAL_RX_SLOTS];
+/* An address that arrives with every slot full replaces the newest
+   line, which mustn't be the one the main loop is working on */
+typedef char too_few_rx_slots[SERIAL_RX_SLOTS>=2?1:-1];
+static uint8_t rxptr,rx_in,rx_out;
+static volatile uint8_t rx_waiting;
+char *rxbuf=rxslots[0];
+uint8_t rx_overflows;
 
 /* Transmit buffer.  txend is the first free byte of the buffer
    (i.e. next byte to be added will go there).  txnext is the next
@@ -47,15 +78,46 @@ char rxbuf[SERIAL_RX_BUFSIZE];
    full and adding a character should block until there is space. */
 static uint8_t txend,txnext;
 static uint8_t txbuf[SERIAL_TX_BUFSIZE];
+/* Set when a character goes to the UART, cleared once it is known to
+   have gone; TXC0 is cleared with each character, so it is set once
+   the last one has left the shift register */
+static volatile uint8_t tx_sending;
+
+/* Uptime by which a valid command must arrive at a new line rate, or 0 */
+static uint32_t baud_deadline;
+
+/* Our bus address, or 0 if we are selected by name */
+static uint8_t address;
+
+/* timer1_count() when the last command line ended */
+static uint32_t line_end;
+/* Milliseconds left before our slot; the transmit buffer is held
+   meanwhile */
+static volatile uint16_t slot_wait;
+static volatile uint8_t tx_held;
+
+/* Timer0 runs at clk/64 for 100us changeovers and 1ms slot counts */
+#define CHANGEOVER_COUNT (F_CPU/64/10000-1)
+#define MS_COUNT (F_CPU/64/1000-1)
 
 uint8_t rx_data_available(void)
 {
-  return (rxptr==0xff);
+  return rx_waiting;
+}
+
+uint8_t serial_address_event(void)
+{
+  return rx_waiting?rx_kind[rx_out]:0;
 }
 
 void ack_rx_data(void)
 {
-  rxptr=0;
+  if (!rx_waiting) return;
+  rx_out=(rx_out+1)%SERIAL_RX_SLOTS;
+  rxbuf=rxslots[rx_out];
+  cli();
+  rx_waiting--;
+  sei();
 }
 
 /* Immediately stop serial transmission */
@@ -71,6 +133,7 @@ static int serial_transmit(char c, FILE *stream)
 {
   uint8_t next;
   (void)stream;
+  if (tx_held) return 0; /* Debug output; don't disturb our slot */
   next=(txend+1)%SERIAL_TX_BUFSIZE;
   /* Block until there is room in the buffer */
   cli();
@@ -90,12 +153,29 @@ static int serial_transmit(char c, FILE *stream)
 static FILE serial_stdout =
   FDEV_SETUP_STREAM(serial_transmit, NULL, _FDEV_SETUP_WRITE);
 
+/* Divider for a line rate in double speed mode, rounded to nearest */
+static uint16_t baud_divider(uint32_t bps)
+{
+  return (F_CPU+4*bps)/(8*bps)-1;
+}
+
 /* Initialise the serial hardware; NB global interrupts must be
    disabled while doing this */
-void serial_init(uint16_t bps)
+void serial_init(uint32_t bps)
 {
-  UBRR0=F_CPU/16/bps-1;
+  address=settings.addr;
+  if (address==0xff) address=0;
+  UCSR0A=(1<<U2X0);
+  UBRR0=baud_divider(bps);
   UCSR0B=(1<<RXEN0)|(1<<TXEN0);
+  if (address) {
+    /* Nine bit characters; ignore all but addresses until ours */
+    UCSR0B|=(1<<UCSZ02);
+    UCSR0A|=(1<<MPCM0);
+  }
+  /* Timer0 counts the changeover when we are deselected, and the
+     wait for our POLLALL slot: CTC mode */
+  TCCR0A=(1<<WGM01);
   UCSR0C=(3<<UCSZ00);
   stdout=&serial_stdout;
 
@@ -103,38 +183,174 @@ void serial_init(uint16_t bps)
   UCSR0B |= (1 << RXCIE0);
 }
 
+/* Forget any POLLALL reply we haven't sent; a SELECT means the head
+   end has moved on */
+static void slot_cancel(void)
+{
+  if (tx_held) {
+    tx_held=0;
+    slot_wait=0;
+    txend=txnext=0;
+  }
+  UCSR0B&=~(1<<TXCIE0);
+}
+
+/* Start driving the bus */
+static void take_bus(void)
+{
+  TCCR0B=0; /* We may not have let go yet */
+  TIMSK0=0;
+  slot_cancel();
+  RS485_XMIT_ON();
+}
+
+/* Let go of the bus once the changeover time is up */
+static void release_bus(void)
+{
+  TCCR0B=0;
+  slot_cancel();
+  OCR0A=CHANGEOVER_COUNT;
+  TCNT0=0;
+  TIFR0=(1<<OCF0A);
+  TIMSK0=(1<<OCIE0A);
+  TCCR0B=(1<<CS01)|(1<<CS00);
+}
+
+ISR(TIMER0_COMPA_vect)
+{
+  if (slot_wait && --slot_wait) return;
+  TCCR0B=0;
+  TIMSK0=0;
+  if (tx_held) {
+    /* Our slot has come: send the reply, and let go when it's gone */
+    tx_held=0;
+    RS485_XMIT_ON();
+    UCSR0A|=(1<<TXC0);
+    UCSR0B|=(1<<UDRIE0)|(1<<TXCIE0);
+    return;
+  }
+  RS485_XMIT_OFF();
+}
+
+/* Transmit complete interrupt; only enabled for a POLLALL reply */
+ISR(USART_TX_vect)
+{
+  UCSR0B&=~(1<<TXCIE0);
+  tx_sending=0; /* Taking this interrupt cleared TXC0 */
+  RS485_XMIT_OFF();
+}
+
+uint8_t serial_send_in_slot(const char *line, uint16_t slot_ms)
+{
+  uint32_t wait,elapsed;
+  if (!address) return 0;
+  wait=(uint32_t)(address-1)*slot_ms*1000; /* Microseconds */
+  cli();
+  /* The main loop usually gets to the command within a few ms, but a
+     probe read or eeprom writes can hold it up for longer */
+  elapsed=(timer1_count()-line_end)/TIMER1_TICKS_PER_US;
+  if (elapsed>wait+(uint32_t)SERIAL_SLOT_LATE_MS*1000) {
+    /* Too late: the reply could run into the next slot */
+    sei();
+    return 0;
+  }
+  wait=(wait>elapsed)?wait-elapsed:0;
+  TCCR0B=0;
+  RS485_XMIT_OFF(); /* In case a changeover was still running */
+  txend=txnext=0;
+  while (*line && txend<SERIAL_TX_BUFSIZE-1) txbuf[txend++]=*line++;
+  tx_held=1;
+  /* The first interrupt comes after the odd part of a millisecond,
+     then one every millisecond */
+  OCR0A=MS_COUNT;
+  TCNT0=MS_COUNT-(wait%1000)*(MS_COUNT+1)/1000;
+  slot_wait=wait/1000+1;
+  TIFR0=(1<<OCF0A);
+  TIMSK0=(1<<OCIE0A);
+  TCCR0B=(1<<CS01)|(1<<CS00);
+  sei();
+  return 1;
+}
+
+/* Slot rx_in is complete, holding a line or an address; move on to
+   the next */
+static void line_done(uint8_t kind)
+{
+  rx_kind[rx_in]=kind;
+  rxptr=0;
+  rx_in=(rx_in+1)%SERIAL_RX_SLOTS;
+  rx_waiting++;
+}
+
 /* Byte received interrupt */
 ISR(USART_RX_vect)
 {
-  uint8_t rxbyte;
+  uint8_t rxbyte,bit8;
+  char *line;
   /* XXX if we are going to deal with receive errors, we should read
      the error flags here */
+  bit8=UCSR0B&(1<<RXB80);
   rxbyte=UDR0;
+  if (address && bit8) {
+    /* An address; anything half received is abandoned */
+    uint8_t kind;
+    if (rxbyte==address) {
+      UCSR0A&=~(1<<MPCM0);
+      take_bus();
+      kind=SERIAL_ADDRESS_US;
+    } else if (rxbyte==SERIAL_BROADCAST) {
+      UCSR0A&=~(1<<MPCM0);
+      release_bus();
+      kind=SERIAL_ADDRESS_ALL;
+    } else {
+      UCSR0A|=(1<<MPCM0);
+      release_bus();
+      kind=SERIAL_ADDRESS_OTHER;
+    }
+    if (rx_waiting==SERIAL_RX_SLOTS) {
+      /* No room: lose the newest line rather than the address, which
+	 says how everything after it is to be dealt with */
+      record_error(&rx_overflows);
+      rx_in=(rx_in+SERIAL_RX_SLOTS-1)%SERIAL_RX_SLOTS;
+      rx_waiting--;
+    }
+    line_done(kind);
+    return;
+  }
+  line=rxslots[rx_in];
   if (rxptr==0xfe) {
     /* Discard characters until '\n' is received */
     if (rxbyte=='\n' || rxbyte=='\r') {
       rxptr=0;
-      return;
     }
-  } else if (rxptr==0xff) {
-    /* Discard characters until command processing is finished */
+    return;
+  } else if (rxptr>0 && line[0]==FRAME_START) {
+    /* Binary frame: newlines are just data */
+    line[rxptr++]=rxbyte;
+    if (rxptr==2 && rxbyte+4>SERIAL_RX_BUFSIZE) {
+      record_error(&rx_overflows); /* Too long for the buffer */
+      rxptr=0xfe;
+    } else if (rxptr>2 && rxptr==(uint8_t)line[1]+4) {
+      line_done(0); /* Complete frame received */
+    }
+    return;
+  } else if ((rxbyte=='\n' || rxbyte=='\r') && rxptr==0) {
+    /* Empty line; nothing to do */
     return;
   } else if (rxbyte=='\n' || rxbyte=='\r') {
     char selectcmd[9];
     /* Complete command received */
-    rxbuf[rxptr]=0;
-    rxptr=0xff;
+    line[rxptr]=0;
+    line_end=timer1_count();
     /* We deal with SELECT commands here in this interrupt routine,
        because we want to be able to stop transmitting immediately on
        receipt of a SELECT for a different unit.  The command is still
        reported to the main loop in the usual way so it can issue an
        ack and do book-keeping. */
     strcpy_P(selectcmd,PSTR("SELECT "));
-    if (strncmp(selectcmd,rxbuf,7)==0) {
-      reg_read_string(&ident,selectcmd,9);
-      if (strcmp(&rxbuf[7],selectcmd)!=0) {
-	_delay_us(100); /* Overlap changeover */
-	RS485_XMIT_OFF();
+    if (strncmp(selectcmd,line,7)==0) {
+      if (strcmp(&line[7],settings.ident)!=0) {
+	release_bus();
       } else {
 	/* I didn't originally want to put this here - I thought we
 	   could enable the transmitter when the main loop picked up
@@ -143,17 +359,23 @@ ISR(USART_RX_vect)
 	   command, presumably because the gap between one transmitter
 	   turning off and the next turning on is being interpreted as
 	   a start bit. */
-	RS485_XMIT_ON();
-	_delay_us(100); /* Overlap changeover */
+	take_bus();
       }
     }
-    rxptr=0xff;
+    line_done(0);
+    return;
+  }
+  if (rxptr==0 && rx_waiting==SERIAL_RX_SLOTS) {
+    /* Every slot is full; lose this line */
+    record_error(&rx_overflows);
+    rxptr=0xfe;
     return;
   }
-  rxbuf[rxptr]=rxbyte;
+  line[rxptr]=rxbyte;
   rxptr++;
   if (rxptr>=SERIAL_RX_BUFSIZE) {
     /* Buffer overflow; now discard characters until '\n' is received */
+    record_error(&rx_overflows);
     rxptr=0xfe;
   }
 }
@@ -166,6 +388,48 @@ ISR(USART_UDRE_vect)
     UCSR0B &= ~(1 << UDRIE0);
     return;
   }
+  UCSR0A|=(1<<TXC0);
   UDR0=txbuf[txnext];
   txnext=(txnext+1)%SERIAL_TX_BUFSIZE;
+  tx_sending=1;
+}
+
+uint8_t serial_baud_possible(uint32_t bps)
+{
+  uint32_t actual;
+  if (bps<2400 || bps>F_CPU/8) return 0;
+  /* The receiver copes with about 2% error */
+  actual=F_CPU/8/(baud_divider(bps)+1);
+  return (actual>bps?actual-bps:bps-actual)*50<=bps;
+}
+
+void serial_set_baud(uint32_t bps)
+{
+  /* Let our reply go at the old rate.  cli() and sei() make sure we
+     look at the buffer afresh each time round. */
+  cli();
+  while (txend!=txnext) {
+    sei();
+    _delay_us(1);
+    cli();
+  }
+  sei();
+  /* The last two characters may still be in the UART */
+  while (tx_sending && !(UCSR0A&(1<<TXC0)));
+  tx_sending=0;
+  UBRR0=baud_divider(bps);
+  baud_deadline=(bps==9600)?0:get_uptime()+BAUD_FALLBACK_SECONDS;
+}
+
+void serial_confirm(void)
+{
+  baud_deadline=0;
+}
+
+void serial_check_baud(void)
+{
+  if (baud_deadline && get_uptime()>=baud_deadline) {
+    /* Nobody is talking to us at this rate */
+    serial_set_baud(9600);
+  }
 }
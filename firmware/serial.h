@@ -3,11 +3,40 @@
 
 #include "config.h"
 
-extern void serial_init(uint16_t bps);
+extern void serial_init(uint32_t bps);
+
+/* Change line rate once everything queued has been sent.  Unless it is
+   9600, serial_confirm() must be called within BAUD_FALLBACK_SECONDS
+   to keep it.  Check the rate with serial_baud_possible() first. */
+extern uint8_t serial_baud_possible(uint32_t bps);
+extern void serial_set_baud(uint32_t bps);
+extern void serial_confirm(void);
+/* Call every time round the main loop */
+extern void serial_check_baud(void);
 
 extern uint8_t rx_data_available(void);
+
+/* With a bus address set, addresses wait their turn with the
+   commands.  What the address character to deal with next did, or 0 if
+   the next thing is a command in rxbuf.  Either way, call
+   ack_rx_data() once it has been dealt with. */
+extern uint8_t serial_address_event(void);
+#define SERIAL_ADDRESS_US 1
+#define SERIAL_ADDRESS_OTHER 2
+#define SERIAL_ADDRESS_ALL 3
+#define SERIAL_BROADCAST 0
+
+/* Send a POLLALL reply in our slot, which starts slot_ms times our
+   address less one after the end of the command line.  Anything else
+   waiting to be sent is dropped.  Returns 0 without sending if we
+   have no address, or if we have got to the command more than
+   SERIAL_SLOT_LATE_MS into our slot. */
+extern uint8_t serial_send_in_slot(const char *line, uint16_t slot_ms);
+#define SERIAL_SLOT_MAX_MS 250
+#define SERIAL_SLOT_LATE_MS 5
 extern void ack_rx_data(void);
 extern void serial_transmit_abort(void);
-extern char rxbuf[SERIAL_RX_BUFSIZE];
+extern char *rxbuf; /* The command to deal with, SERIAL_RX_BUFSIZE bytes */
+extern uint8_t rx_overflows; /* Lines lost for lack of room */
 
 #endif /* _serial_h */
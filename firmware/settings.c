@@ -0,0 +1,72 @@
+#include <util/crc16.h>
+#include "settings.h"
+#include "registers.h"
+#include "ee.h"
+#include "profile.h"
+
+struct settings settings;
+uint8_t settings_crc_errors; /* Settings didn't match their CRC at boot */
+
+static void read_setting(const struct reg *reg, void *buf)
+{
+  struct storage s;
+  s=reg_storage(reg);
+  ee_read_block(buf,(void *)s.loc.eeprom.start,s.loc.eeprom.length);
+}
+
+static void read_string(const struct reg *reg, char *buf)
+{
+  read_setting(reg,buf);
+  buf[8]=0;
+  if (buf[0]==-1) buf[0]=0; /* Uninitialised eeprom */
+}
+
+static void read_settings(void)
+{
+  read_string(&ident,settings.ident);
+  read_string(&mode,settings.mode);
+  read_setting(&set_hi,&settings.set_hi);
+  read_setting(&set_lo,&settings.set_lo);
+  read_setting(&alarm_hi,&settings.alarm_hi);
+  read_setting(&alarm_lo,&settings.alarm_lo);
+  read_setting(&jog_hi,&settings.jog_hi);
+  read_setting(&jog_lo,&settings.jog_lo);
+  read_setting(&bl,&settings.bl);
+  read_setting(&blalarm,&settings.blalarm);
+  read_setting(&jog_flip,&settings.jog_flip);
+  read_setting(&jog_wait,&settings.jog_wait);
+  read_setting(&fpsetup,&settings.fpsetup);
+  read_setting(&vtype,&settings.vtype);
+  read_setting(&busaddr,&settings.addr);
+}
+
+static uint16_t settings_crc(void)
+{
+  const uint8_t *p=(const uint8_t *)&settings;
+  uint16_t crc=0xffff;
+  uint8_t n;
+  for (n=0; n<sizeof(settings); n++) crc=_crc16_update(crc,*p++);
+  return crc;
+}
+
+void settings_init(void)
+{
+  uint16_t crc,stored;
+  read_settings();
+  crc=settings_crc();
+  stored=ee_read_word((void *)SETTINGS_CRC_EEPROM);
+  if (stored!=crc) {
+    /* A blank CRC has never been written, eg. on the first boot of
+       this firmware.  Either way, we carry on with what we have and
+       only complain once. */
+    if (stored!=0xffff) record_error(&settings_crc_errors);
+    ee_update_word((void *)SETTINGS_CRC_EEPROM,crc);
+  }
+}
+
+void settings_changed(void)
+{
+  read_settings();
+  ee_update_word((void *)SETTINGS_CRC_EEPROM,settings_crc());
+  profile_settings_loaded();
+}
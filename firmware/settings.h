@@ -0,0 +1,37 @@
+#ifndef _settings_h
+#define _settings_h
+
+#include <stdint.h>
+
+/* RAM copy of the settings used by the main loop, the display and the
+   control loops, so they need not go to eeprom for them.  It is loaded
+   at boot and reloaded whenever one of them is written; anything that
+   writes them in eeprom must call settings_changed() afterwards.  A
+   CRC of the settings is kept in eeprom (see eeprom-layout) so that
+   corruption, eg. by a brownout, shows up in err/cfg. */
+struct settings {
+  char ident[9]; /* Strings are NUL-terminated; empty if unset */
+  char mode[9];
+  int32_t set_hi,set_lo;
+  int32_t alarm_hi,alarm_lo;
+  int32_t jog_hi,jog_lo;
+  uint16_t bl; /* Tenths of a second */
+  uint8_t blalarm; /* Tenths of a second */
+  uint16_t jog_flip,jog_wait;
+  uint8_t fpsetup;
+  uint8_t vtype;
+  uint8_t addr; /* Bus address; see serial.c */
+};
+
+#define SETTINGS_CRC_EEPROM 0x3e8
+
+extern struct settings settings;
+extern uint8_t settings_crc_errors;
+
+/* Call once at boot, before anything uses the settings */
+extern void settings_init(void);
+
+/* Call after writing any of the settings in eeprom */
+extern void settings_changed(void);
+
+#endif /* _settings_h */
@@ -1,5 +1,4 @@
 #include <avr/pgmspace.h>
-#include <avr/eeprom.h>
 #include <util/delay.h>
 #include <stdio.h>
 #include <string.h>
@@ -10,21 +9,12 @@
 #include "owb.h"
 #include "temp.h"
 #include "hardware.h"
-#include "registers.h"
+#include "ee.h"
 
 static void assign_probe(uint8_t *addr)
 {
-  const struct reg *r;
-  struct storage s;
-
-  r=reg_by_name_P(PSTR("t0/id"));
-  if (!r) {
-    lcd_message_P(PSTR("Can't find t0/id"));
-    _delay_ms(1000);
-    return;
-  }
-  s=reg_storage(r);
-  eeprom_write_block(addr,(void *)s.loc.eeprom.start,8);
+  ee_update_block(addr,(void *)PROBE_EEPROM(0)+PROBE_ID,8);
+  probe_config_changed();
   lcd_message_P(PSTR("Assigned"));
   _delay_ms(1000);
 }
@@ -49,7 +39,9 @@ void sensor_setup(void)
   owb_start_temp_conversion();
   _delay_ms(1000);
   
-  device_count=owb_count_devices();
+  /* Enumerate the bus afresh, in case a sensor has just been plugged
+     in */
+  device_count=owb_scan(1);
   ack_buttons();
   if (device_count==-1) {
     lcd_message_P(PSTR("Bus shorted\nto ground."));
@@ -76,7 +68,7 @@ void sensor_setup(void)
      exits. */
   do {
     for (i=0; i<device_count; i++) {
-      owb_get_addr(addr,i);
+      memcpy(addr,owb_devices[i].addr,8);
       owb_format_addr(addr,buf,sizeof(buf));
       strcat_P(buf,PSTR("\n"));
       temp=owb_read_temp(addr);
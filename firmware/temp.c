@@ -1,13 +1,13 @@
 #include <stdio.h>
 #include <inttypes.h>
-#include <avr/eeprom.h>
-#include <avr/interrupt.h>
+#include <string.h>
 #include "temp.h"
-#include "hardware.h"
 #include "registers.h"
 #include "owb.h"
-#include "alarm.h"
 #include "timer.h"
+#include "control.h"
+#include "settings.h"
+#include "ee.h"
 
 /* The hardware reads out temperatures in multiples of 1/16 degree
    (0.0625).  We then take that and apply calibration data,
@@ -15,210 +15,460 @@
    temperature in the firmware is a ten-thousandth of a degree in an
    int32_t. */
 
-int32_t t0_temp=BAD_TEMP;
-int32_t t1_temp=BAD_TEMP;
-int32_t t2_temp=BAD_TEMP;
-int32_t t3_temp=BAD_TEMP;
-/* NB v0_state and desired_v0_state are separate because we don't want
-   changes to v0_state made by the "jog" code to affect the
-   desired_v0_state hysteresis state in the event that t0 is between
-   the low and high set points. */
-uint8_t v0_state; /* How we are driving v0 at the moment */
-uint8_t desired_v0_state; /* Desired valve state: 0=closed, 1=open */
-uint8_t v1_output_on;
-uint8_t v2_output_on;
-static uint8_t jiggling; /* Are we jiggling the valve to unstick it? */
+/* Probes are read in the background.  Each probe has its own read
+   period and resolution.  When any probes are due we set their
+   resolution if necessary, start conversions on them, poll the bus
+   until the conversions have finished and then read each one in turn.
+   A probe that keeps failing is read less and less often, so missing
+   probes can't use up the bus time needed by the others.
 
-static void trigger_jog_timer(const struct reg *reg)
+   Each probe's alarm bytes are set from alarm/hi and alarm/lo.
+   Whenever the control probe t0 is due we convert on every probe and
+   use an alarm search to find any that are out of bounds, so only
+   those need reading before their own period comes round. */
+#define PROBE_BIT(n) ((uint16_t)1<<(n))
+struct probe probes[PROBES];
+uint16_t probe_alarms; /* Probes last read outside the alarm limits */
+static uint8_t probe_reload=1; /* Probe configuration needs loading */
+static uint16_t probe_active; /* Probes with an address set */
+static uint16_t probe_configured; /* Probes set to the right resolution etc. */
+static uint16_t probe_convert; /* Probes converting this time round */
+static uint16_t probe_cycle; /* Probes being read this time round */
+static uint16_t probe_pending; /* Probes still to deal with in this state */
+static uint8_t probe_index; /* Probe we are dealing with now */
+static uint8_t probe_tries;
+static uint8_t probe_wait; /* Tenths of a second left for conversion */
+/* While polling, the seq of our last transfer; polling stops if
+   anything else uses the bus, and we wait out probe_wait instead */
+static uint8_t probe_seq;
+static uint8_t probe_polling;
+static uint16_t probe_due; /* Probes whose read period has expired */
+static uint8_t control_due; /* t0 is due: check for probes in alarm */
+static int32_t probe_a_hi,probe_a_lo; /* alarm/hi and alarm/lo */
+static uint8_t probe_limits_stale=1; /* Alarm bytes need working out */
+static struct owb_xfer probe_xfer;
+
+#define PROBES_IDLE 0
+#define PROBES_SETUP 1 /* Setting resolution on probes that need it */
+#define PROBES_CONVERT 2 /* Starting conversions */
+#define PROBES_POLL 3 /* Waiting for conversions to finish */
+#define PROBES_ALARM 4 /* Searching for probes in alarm */
+#define PROBES_READ 5 /* Reading results */
+static uint8_t probe_state;
+
+void probe_config_changed(void)
 {
-  struct storage s;
-  s=reg_storage(reg);
-  cli();
-  jog_timer=eeprom_read_word((void *)s.loc.eeprom.start);
-  sei();
+  probe_reload=1;
 }
 
-/* NB expects name to be a pointer to a string in progmem */
-static int32_t read_probe(const char *name)
+/* a*b>>16, rounded down, in 32-bit arithmetic (the 64-bit routines
+   cost too much flash); b must not be negative.  Splitting both into
+   16-bit halves leaves only the low halves' product to need 32 bits
+   unsigned. */
+static int32_t mul_q16(int32_t a, int32_t b)
 {
-  uint8_t addr[8];
-  const struct reg *r;
-  struct storage s;
-  char regname[9];
-
-  strncpy_P(regname,name,9);
-  strncat_P(regname,PSTR("/id"),9);
-  r=reg_by_name(regname);
-  s=reg_storage(r);
-  eeprom_read_block(addr,(void *)s.loc.eeprom.start,8);
-  return owb_read_temp(addr);
+  int32_t ah=a>>16,bh=b>>16;
+  uint16_t al=a,bl=b;
+  return a*bh+ah*bl+(int32_t)(((uint32_t)al*bl)>>16);
 }
 
-void read_probes(void)
+/* Work out a probe's calibration slope and offset from the
+   calibration points at eeprom address a */
+static void load_calibration(struct probe *p, uint16_t a)
 {
-  struct storage s;
-  int32_t s_hi,s_lo;
-  int32_t a_hi,a_lo;
-  int32_t j_hi,j_lo;
-  uint8_t valve;
-
-  t0_temp=read_probe(PSTR("t0"));
-  t1_temp=read_probe(PSTR("t1"));
-  t2_temp=read_probe(PSTR("t2"));
-  t3_temp=read_probe(PSTR("t3"));
-
-  /* Don't be a thermostat if we don't have a reading */
-  if (t0_temp==BAD_TEMP) {
-    SET_ALARM(ALARM_NO_TEMPERATURE);
+  int16_t c0,c0r,c1,c1r;
+  int32_t slope=(int32_t)1<<16,d;
+  c0=ee_read_word((void *)a+PROBE_C0);
+  c0r=ee_read_word((void *)a+PROBE_C0R);
+  c1=ee_read_word((void *)a+PROBE_C1);
+  c1r=ee_read_word((void *)a+PROBE_C1R);
+  if (c0==PROBE_CAL_UNSET || c0r==PROBE_CAL_UNSET) {
+    p->cal_slope=slope;
+    p->cal_offset=0;
     return;
   }
-  UNSET_ALARM(ALARM_NO_TEMPERATURE);
-
-  /* Read necessary registers from eeprom */
-  s=reg_storage(&set_hi);
-  eeprom_read_block(&s_hi,(void *)s.loc.eeprom.start,4);
-  s=reg_storage(&set_lo);
-  eeprom_read_block(&s_lo,(void *)s.loc.eeprom.start,4);
-  s=reg_storage(&alarm_hi);
-  eeprom_read_block(&a_hi,(void *)s.loc.eeprom.start,4);
-  s=reg_storage(&alarm_lo);
-  eeprom_read_block(&a_lo,(void *)s.loc.eeprom.start,4);
-  s=reg_storage(&jog_hi);
-  eeprom_read_block(&j_hi,(void *)s.loc.eeprom.start,4);
-  s=reg_storage(&jog_lo);
-  eeprom_read_block(&j_lo,(void *)s.loc.eeprom.start,4);
-  s=reg_storage(&vtype);
-  valve=eeprom_read_byte((void *)s.loc.eeprom.start);
-
-  /* Check alarm temperatures */
-  if (t0_temp>a_hi) {
-    SET_ALARM(ALARM_TEMPERATURE_HIGH);
-  } else {
-    UNSET_ALARM(ALARM_TEMPERATURE_HIGH);
-  }
-  if (t0_temp<a_lo) {
-    SET_ALARM(ALARM_TEMPERATURE_LOW);
-  } else {
-    UNSET_ALARM(ALARM_TEMPERATURE_LOW);
+  d=(int32_t)c1-c0;
+  if (c1!=PROBE_CAL_UNSET && c1r!=PROBE_CAL_UNSET && c1r!=c0r &&
+      d>-32768 && d<32768) {
+    slope=(d<<16)/((int32_t)c1r-c0r);
+    /* Readings going down as the temperature goes up, or a scale that
+       far from 1, can only be a mistake; just use the offset */
+    if (slope<((int32_t)1<<14) || slope>((int32_t)4<<16)) {
+      slope=(int32_t)1<<16;
+    }
   }
-  
-  /* Be a thermostat, with valve opened to provide chilling */
-  if (t0_temp>s_hi) {
-    desired_v0_state=1;
+  p->cal_slope=slope;
+  p->cal_offset=(int32_t)c0*100-mul_q16((int32_t)c0r*100,slope);
+}
+
+static int32_t calibrate(const struct probe *p, int32_t t)
+{
+  return p->cal_offset+mul_q16(t,p->cal_slope);
+}
+
+/* What the probe would read at calibrated temperature t, to the
+   hundredth of a degree, which is plenty for alarm bytes */
+static int32_t uncalibrate(const struct probe *p, int32_t t)
+{
+  int32_t d;
+  d=(t-p->cal_offset)/100;
+  if (d>32767) d=32767;
+  if (d<-32767) d=-32767;
+  return (d<<16)/p->cal_slope*100;
+}
+
+/* Fetch every probe's configuration from eeprom */
+static void load_probes(void)
+{
+  uint8_t n,f;
+  uint8_t addr[8];
+  struct probe *p;
+  probe_active=0;
+  for (n=0, p=probes; n<PROBES; n++, p++) {
+    ee_read_block(addr,(void *)PROBE_EEPROM(n)+PROBE_ID,8);
+    if (memcmp(addr,p->addr,8)!=0) {
+      /* A different probe: forget everything about the old one */
+      memcpy(p->addr,addr,8);
+      p->temp=BAD_TEMP;
+      p->raw=BAD_TEMP;
+      p->samples=0;
+      p->failures=0;
+      p->skip=0;
+    }
+    load_calibration(p,PROBE_EEPROM(n));
+    p->res=ee_read_byte((void *)PROBE_CONFIG(n)+PROBE_RES);
+    if (p->res<9 || p->res>12) p->res=12;
+    p->period=ee_read_byte((void *)PROBE_CONFIG(n)+PROBE_PERIOD);
+    if (p->period==0 || p->period==0xff) p->period=TEMPERATURE_PROBE_PERIOD;
+    f=ee_read_byte((void *)PROBE_CONFIG(n)+PROBE_FILTER);
+    if (f>PROBE_FILTER_EMA) f=PROBE_FILTER_NONE;
+    if (f!=p->filter) {
+      p->filter=f;
+      p->samples=0;
+    }
+    p->shift=ee_read_byte((void *)PROBE_CONFIG(n)+PROBE_SHIFT);
+    if (p->shift<1 || p->shift>8) p->shift=PROBE_DEFAULT_SHIFT;
+    if (!owb_addr_unset(p->addr)) probe_active|=PROBE_BIT(n);
   }
-  if (t0_temp<s_lo) {
-    desired_v0_state=0;
+  probe_configured=0;
+  probe_limits_stale=1;
+  probe_reload=0;
+}
+
+/* Probes compare only the whole-degree part of a reading with their
+   alarm bytes, so round down: a probe may then be flagged when it is
+   just inside the limit, but the full read sorts that out. */
+static int8_t alarm_byte(int32_t t)
+{
+  if (t>=0) t=t/10000;
+  else t=-((-t+9999)/10000);
+  if (t>127) return 127;
+  if (t<-128) return -128;
+  return t;
+}
+
+/* Fetch the alarm limits.  The probes compare their uncalibrated
+   readings with their alarm bytes, so each probe needs its own; any
+   probe whose alarm bytes change needs setting up again. */
+static void read_alarm_limits(void)
+{
+  struct probe *p;
+  int32_t hi,lo;
+  int8_t th,tl;
+  uint8_t n;
+  hi=settings.alarm_hi;
+  lo=settings.alarm_lo;
+  if (hi==probe_a_hi && lo==probe_a_lo && !probe_limits_stale) return;
+  probe_a_hi=hi;
+  probe_a_lo=lo;
+  probe_limits_stale=0;
+  for (n=0, p=probes; n<PROBES; n++, p++) {
+    th=alarm_byte(uncalibrate(p,hi));
+    tl=alarm_byte(uncalibrate(p,lo));
+    if (th!=p->th || tl!=p->tl) {
+      p->th=th;
+      p->tl=tl;
+      probe_configured&=~PROBE_BIT(n);
+    }
   }
+}
+
+/* Work out which probes are due to be converted and read */
+static void start_cycle(void)
+{
+  uint8_t n,due;
+  struct probe *p;
 
-  v0_state=desired_v0_state;
-
-  /* Check "jog" temperatures.  If temperature is out of bounds, we
-     assume that our valve may be stuck and jiggle it to try to free
-     it.  We invert v0_state for jog/flip and then wait jog/wait
-     before trying again.  We have one timer for this, jog_timer,
-     which counts down to zero and then stays there until we reset it.
-  */
-  if (t0_temp<j_lo || t0_temp>j_hi) {
-    SET_ALARM(ALARM_VALVE_STUCK);
-    if (jog_timer==0) {
-      jiggling=!jiggling;
-      if (jiggling) {
-	trigger_jog_timer(&jog_flip);
-      } else {
-	trigger_jog_timer(&jog_wait);
+  if (probe_reload) load_probes();
+  probe_convert=0;
+  probe_cycle=0;
+  for (n=0, p=probes; n<PROBES; n++, p++) {
+    due=(p->timer==0);
+    if (due) {
+      p->timer=p->period;
+      probe_due|=PROBE_BIT(n);
+      if (n==0) {
+	control_due=1;
+	read_alarm_limits();
       }
+    } else if (!control_due) {
+      continue;
     }
-    if (jiggling) v0_state=!v0_state;
-  } else {
-    /* Temperature is within bounds.  If the flip timer expires, start the
-       wait timer. */
-    UNSET_ALARM(ALARM_VALVE_STUCK);
-    if (jiggling && jog_timer==0) {
-      jiggling=0;
-      trigger_jog_timer(&jog_wait);
+    if (!(probe_active & PROBE_BIT(n))) continue;
+    if (p->skip) {
+      if (due) p->skip--;
+      continue;
     }
+    probe_convert|=PROBE_BIT(n);
+    if (due) probe_cycle|=PROBE_BIT(n);
   }
+}
 
-  switch (valve) {
-  case 0:
-  case 0xff:
-    /* Spring-return valve on VALVE1, nothing on VALVE2 */
-    if (v0_state && !v1_output_on) {
-      trigger_relay(VALVE1_SET);
-      v1_output_on=1;
+/* Take the next probe from probe_pending and make it current; if
+   by_res is set, take the one with the lowest resolution first.
+   Returns 0 if there are none left. */
+static uint8_t next_pending(uint8_t by_res)
+{
+  uint8_t n;
+  probe_index=PROBES;
+  for (n=0; n<PROBES; n++) {
+    if (!(probe_pending & PROBE_BIT(n))) continue;
+    if (probe_index==PROBES ||
+	(by_res && probes[n].res<probes[probe_index].res)) {
+      probe_index=n;
     }
-    if (!v0_state && v1_output_on) {
-      trigger_relay(VALVE1_RESET);
-      v1_output_on=0;
+  }
+  if (probe_index==PROBES) return 0;
+  probe_pending&=~PROBE_BIT(probe_index);
+  return 1;
+}
+
+/* Queue a read of the current probe */
+static void submit_probe(void)
+{
+  owb_read_temp_submit(&probe_xfer,probes[probe_index].addr);
+}
+
+/* Note a probe found by the alarm search, so it gets read */
+static void probe_flagged(const uint8_t *id)
+{
+  uint8_t n;
+  for (n=0; n<PROBES; n++) {
+    if ((probe_convert & PROBE_BIT(n)) &&
+	memcmp(probes[n].addr,id,8)==0) {
+      probe_cycle|=PROBE_BIT(n);
+      return;
     }
+  }
+}
+
+/* Median of the last n readings, or of as many as we have */
+static int32_t probe_median(struct probe *p, uint8_t n)
+{
+  int32_t s[PROBE_HISTORY];
+  int32_t t;
+  uint8_t i,j,k;
+  if (p->samples<n) n=p->samples;
+  /* Insertion sort the most recent n readings */
+  k=p->next;
+  for (i=0; i<n; i++) {
+    k=(k==0)?PROBE_HISTORY-1:k-1;
+    t=p->history[k];
+    for (j=i; j>0 && s[j-1]>t; j--) s[j]=s[j-1];
+    s[j]=t;
+  }
+  return s[n/2];
+}
+
+/* Filter a good reading into p->temp */
+static void probe_filter(struct probe *p, int32_t t)
+{
+  switch (p->filter) {
+  case PROBE_FILTER_MEDIAN3:
+  case PROBE_FILTER_MEDIAN5:
+    p->history[p->next]=t;
+    if (++p->next>=PROBE_HISTORY) p->next=0;
+    if (p->samples<PROBE_HISTORY) p->samples++;
+    p->temp=probe_median(p,p->filter==PROBE_FILTER_MEDIAN3?3:5);
     break;
-  case 1: /* Ball valve: open on VALVE1, close on VALVE2, no limit sensors */
-  case 2: /* As case 1, but with limit sensors */
-    if (v0_state) {
-      /* VALVE1 should be energised, VALVE2 should be de-energised */
-      if (v2_output_on) {
-	trigger_relay(VALVE2_RESET);
-	v2_output_on=0;
-      }
-      if (!v1_output_on) {
-	trigger_relay(VALVE1_SET);
-	v1_output_on=1;
-      }
+  case PROBE_FILTER_EMA:
+    if (p->samples==0) {
+      p->samples=1;
+      p->temp=t;
     } else {
-      /* VALVE1 should be de-energised, VALVE2 should be energised */
-      if (v1_output_on) {
-	trigger_relay(VALVE1_RESET);
-	v1_output_on=0;
-      }
-      if (!v2_output_on) {
-	trigger_relay(VALVE2_SET);
-	v2_output_on=1;
-      }
+      /* Shifting right rounds towards minus infinity; add half so the
+	 average settles on t rather than just below it */
+      p->temp+=(t-p->temp+((int32_t)1<<(p->shift-1)))>>p->shift;
     }
     break;
+  default:
+    p->temp=t;
+    break;
   }
 }
 
-uint8_t get_valve_state(void)
+/* Record the outcome of reading the current probe */
+static void probe_result(int32_t t)
 {
-  struct storage s;
-  uint8_t valve,v1,v2;
+  struct probe *p=&probes[probe_index];
+  uint8_t f;
+  p->raw=t;
+  if (t!=BAD_TEMP) {
+    probe_filter(p,calibrate(p,t));
+    t=p->temp;
+    p->failures=0;
+    if (owb_read_temp_res(&probe_xfer)!=p->res) {
+      probe_configured&=~PROBE_BIT(probe_index);
+    }
+    if (t>probe_a_hi || t<probe_a_lo) {
+      probe_alarms|=PROBE_BIT(probe_index);
+    } else {
+      probe_alarms&=~PROBE_BIT(probe_index);
+    }
+    return;
+  }
+  /* Don't keep acting on an old reading; start filtering afresh when
+     the probe comes back */
+  p->temp=BAD_TEMP;
+  p->samples=0;
+  /* The probe may have been replaced or lost power, so set its
+     resolution again next time */
+  probe_configured&=~PROBE_BIT(probe_index);
+  f=p->failures;
+  if (f<0xff) p->failures=++f;
+  /* Back off exponentially: after n consecutive failures, skip
+     2^(n-1)-1 reads */
+  if (f>PROBE_BACKOFF_LIMIT) f=PROBE_BACKOFF_LIMIT;
+  p->skip=(1<<(f-1))-1;
+}
 
-  /* Read valve mode from eeprom */
-  s=reg_storage(&vtype);
-  valve=eeprom_read_byte((void *)s.loc.eeprom.start);
+static void start_reading(void)
+{
+  probe_pending=probe_cycle;
+  probe_state=PROBES_READ;
+  if (next_pending(0)) {
+    probe_tries=OWB_READ_TRIES;
+    submit_probe();
+  }
+}
 
-  v1=read_valve(VALVE1_STATE);
-  v2=read_valve(VALVE2_STATE);
+/* Called every time round the main loop.  The bus transfers run in
+   the background, so we never wait for the bus here. */
+void read_probes(void)
+{
+  uint8_t n,res;
+  int32_t t;
+  struct probe *p;
 
-  switch (valve) {
-  case 0:
-  case 0xff:
-    /* Spring-return valve on VALVE1, nothing on VALVE2 */
-    if (v0_state) {
-      if (v1) return VALVE_OPEN;
-      else return VALVE_OPENING;
-    } else {
-      if (v1) return VALVE_CLOSING;
-      else return VALVE_CLOSED;
+  /* Count down read periods and conversion time at 10Hz */
+  if (tprobe_timer==0) {
+    tprobe_timer=1;
+    for (n=0; n<PROBES; n++) {
+      if (probes[n].timer) probes[n].timer--;
     }
-    break;
-  case 1: /* Ball valve with no limit sensors */
-    if (v0_state) return VALVE_OPEN;
-    else return VALVE_CLOSED;
-    break;
-  case 2: /* Ball valve with open limit sensor on VALVE1 and closed limit
-	     sensor on VALVE2 */
-    if (v0_state) {
-      if (v1 && !v2) return VALVE_OPEN;
-      if (v1 && v2) return VALVE_ERROR;
-      return VALVE_OPENING;
-    } else {
-      if (v2 && !v1) return VALVE_CLOSED;
-      if (v1 && v2) return VALVE_ERROR;
-      return VALVE_CLOSING;
+    if (probe_wait) probe_wait--;
+  }
+
+  if (owb_busy(&probe_xfer)) return;
+
+  switch (probe_state) {
+  case PROBES_IDLE:
+    start_cycle();
+    if (!probe_convert) break;
+    probe_pending=probe_convert;
+    probe_state=PROBES_SETUP;
+    /* fall through */
+  case PROBES_SETUP:
+    while (next_pending(0)) {
+      if (!(probe_configured & PROBE_BIT(probe_index))) {
+	probe_configured|=PROBE_BIT(probe_index);
+	p=&probes[probe_index];
+	owb_write_config_submit(&probe_xfer,p->addr,p->th,p->tl,p->res);
+	return;
+      }
+    }
+    probe_state=PROBES_CONVERT;
+    if (probe_convert==probe_active) {
+      /* Every probe is due; start them all at once */
+      owb_convert_submit(&probe_xfer,NULL);
+      return;
+    }
+    probe_pending=probe_convert;
+    /* fall through */
+  case PROBES_CONVERT:
+    /* We can only poll the conversion started last, so start the
+       longest conversions last */
+    if (next_pending(1)) {
+      owb_convert_submit(&probe_xfer,probes[probe_index].addr);
+      return;
+    }
+    res=9;
+    for (n=0; n<PROBES; n++) {
+      if ((probe_convert & PROBE_BIT(n)) && probes[n].res>res) {
+	res=probes[n].res;
+      }
+    }
+    /* Conversion takes up to 750ms at 12 bits, halving for each bit
+       less; give up polling a little after that */
+    probe_wait=(750>>(12-res))/100+2;
+    probe_state=PROBES_POLL;
+    probe_seq=probe_xfer.seq;
+    probe_polling=1;
+    owb_convert_poll_submit(&probe_xfer);
+    return;
+  case PROBES_POLL:
+    if (probe_polling) {
+      if (probe_xfer.seq!=(uint8_t)(probe_seq+1)) {
+	/* The bus has been reset since the conversion started, so the
+	   poll tells us nothing */
+	probe_polling=0;
+      } else if (!owb_convert_done(&probe_xfer) && probe_wait) {
+	probe_seq=probe_xfer.seq;
+	owb_convert_poll_submit(&probe_xfer);
+	return;
+      }
+    }
+    if (!probe_polling && probe_wait) return;
+    if (control_due) {
+      probe_state=PROBES_ALARM;
+      owb_alarm_search_submit(&probe_xfer,1);
+      return;
+    }
+    start_reading();
+    return;
+  case PROBES_ALARM:
+    /* The search fails straight away if no probe is in alarm */
+    if (owb_search_found(&probe_xfer)) {
+      probe_flagged(owb_search_id(&probe_xfer));
+      if (probe_xfer.diff) {
+	owb_alarm_search_submit(&probe_xfer,0);
+	return;
+      }
     }
+    start_reading();
+    return;
+  case PROBES_READ:
+    t=owb_read_temp_complete(&probe_xfer);
+    /* Only retry straight away if the transfer worked but the data was
+       bad; anything else will still be wrong now. */
+    if (t==BAD_TEMP && probe_xfer.status==OWB_DONE && --probe_tries>0) {
+      submit_probe();
+      return;
+    }
+    probe_result(t);
+    if (next_pending(0)) {
+      probe_tries=OWB_READ_TRIES;
+      submit_probe();
+      return;
+    }
+    probe_state=PROBES_IDLE;
     break;
   }
-  return VALVE_ERROR;
+
+  /* Run the control loops on the new readings */
+  control_due=0;
+  if (probe_due) {
+    control_run(probe_due);
+    probe_due=0;
+  }
 }
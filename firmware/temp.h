@@ -2,24 +2,69 @@
 #define _temp_h
 
 #include <stdint.h>
+#include "config.h"
 
+/* Call every time round the main loop; returns without waiting for
+   the one-wire bus */
 extern void read_probes(void);
 
 #define BAD_TEMP 0x7FFFFFFF
 
-extern int32_t t0_temp;
-extern int32_t t1_temp;
-extern int32_t t2_temp;
-extern int32_t t3_temp;
-extern uint8_t v0_state;
-extern uint8_t v1_output_on;
-extern uint8_t v2_output_on;
-
-extern uint8_t get_valve_state(void);
-#define VALVE_CLOSED 0
-#define VALVE_OPENING 1
-#define VALVE_OPEN 2
-#define VALVE_CLOSING 3
-#define VALVE_ERROR 4
+/* Per-probe addresses and calibration in eeprom; the first four
+   probes fit below the set points, the rest go after the modes.  See
+   eeprom-layout. */
+#define PROBE_EEPROM(n) ((n)<4?0x010+(n)*16:0x0c0+((n)-4)*16)
+#define PROBE_ID 0x0
+#define PROBE_C0 0x8
+#define PROBE_C0R 0xa
+#define PROBE_C1 0xc
+#define PROBE_C1R 0xe
+/* Calibration points are int16 hundredths of a degree: c0 is a
+   temperature and c0r what the probe reads at that temperature, and
+   likewise c1 and c1r.  With one point set the reading is offset; with
+   both it is scaled too. */
+#define PROBE_CAL_UNSET ((int16_t)0xffff)
+
+/* Per-probe configuration in eeprom; see eeprom-layout */
+#define PROBE_CONFIG(n) (0x1c0+(n)*4)
+#define PROBE_RES 0 /* Resolution in bits, 9-12 */
+#define PROBE_PERIOD 1 /* Read period in tenths of a second */
+#define PROBE_FILTER 2 /* One of the PROBE_FILTER_* values below */
+#define PROBE_SHIFT 3 /* Exponential average weight: 1/2^shift, 1-8 */
+
+#define PROBE_FILTER_NONE 0
+#define PROBE_FILTER_MEDIAN3 1 /* Median of the last 3 readings */
+#define PROBE_FILTER_MEDIAN5 2 /* Median of the last 5 readings */
+#define PROBE_FILTER_EMA 3 /* Exponential moving average */
+#define PROBE_HISTORY 5
+
+/* Everything we know about a probe.  Probe 0 is the control probe
+   used by the thermostat. */
+struct probe {
+  uint8_t addr[8]; /* Bus address; all ones if unset */
+  int32_t temp; /* Filtered reading, or BAD_TEMP */
+  int32_t raw; /* Latest reading before calibration, or BAD_TEMP */
+  int32_t history[PROBE_HISTORY]; /* Recent readings for median filters */
+  uint8_t samples; /* Readings in history, or taken since EMA reset */
+  uint8_t next; /* Where the next reading goes in history */
+  uint8_t filter; /* PROBE_FILTER_* */
+  uint8_t shift; /* For PROBE_FILTER_EMA */
+  /* Calibrated reading is cal_offset+(reading*cal_slope>>16), worked
+     out from the calibration points whenever they change */
+  int32_t cal_slope;
+  int32_t cal_offset;
+  int8_t th,tl; /* Alarm bytes for the probe */
+  uint8_t res; /* Resolution in bits */
+  uint8_t period; /* Tenths of a second between reads */
+  uint8_t timer; /* Tenths of a second until next read */
+  uint8_t failures; /* Consecutive failed reads */
+  uint8_t skip; /* Reads left to skip before next try */
+};
+
+extern struct probe probes[PROBES];
+extern uint16_t probe_alarms;
+
+/* Call after changing any probe's configuration in eeprom */
+extern void probe_config_changed(void);
 
 #endif /* _temp_h */
@@ -2,22 +2,29 @@
 #include <avr/interrupt.h>
 #include <util/delay.h>
 #include "buttons.h"
+#include "timer.h"
+
+/* Timer1 runs freely and is shared: compare A generates our 10Hz
+   tick, and compare B and input capture are used by the one-wire bus
+   code to time bus slots. */
+#define TICK_PERIOD 50000 /* 25ms */
+#define TICK_DIVIDER 4
 
 void timer_init(void)
 {
   /* Set up timer1 to generate an interrupt every 0.1 seconds */
   /* Write PRTIM0 bit to zero to enable timer0  - this is the default value */
 
-  /* Select the clock source - clk/64 = 250KHz */
-  TCCR1B=(1<<CS11)|(1<<CS10);
-  
-  /* To get an interrupt at 10Hz we need to count up to 25000. */
-  OCR1A=25000;
+  /* Select the clock source - clk/8 = 2MHz, normal mode.  Enable the
+     input capture noise canceller for the one-wire bus. */
+  TCCR1A=0;
+  TCCR1B=(1<<CS11)|(1<<ICNC1);
 
-  /* Use CTC mode (WGM13:0=4) to reset counter when it reaches OCR1A */
-  TCCR1B|=(1<<WGM12);
+  /* A 16-bit timer can't count to 0.1s at this rate, so we take an
+     interrupt every 25ms and count four of them. */
+  OCR1A=TCNT1+TICK_PERIOD;
 
-  /* Set OCF1A to enable interrupt on TOP */
+  /* Set OCF1A to enable interrupt on match */
   TIFR1=(1<<OCF1A);
 
   /* Enable interrupt */
@@ -28,9 +35,50 @@ uint8_t tprobe_timer;
 uint8_t alarm_timer;
 uint16_t backlight_timer;
 uint16_t jog_timer;
+static uint32_t uptime; /* Seconds since reset */
+static uint16_t ticks; /* Tenths of a second, wrapping */
+static uint32_t compares; /* Compare A interrupts since reset */
+
+uint32_t get_uptime(void)
+{
+  uint32_t t;
+  cli();
+  t=uptime;
+  sei();
+  return t;
+}
+
+uint16_t get_ticks(void)
+{
+  uint16_t t;
+  cli();
+  t=ticks;
+  sei();
+  return t;
+}
+
+/* TCNT1 alone wraps every 32ms, so count whole tick periods as well.
+   If compare A is due but not yet dealt with, TCNT1 is just further on
+   from the last one, which still gives the right answer. */
+uint32_t timer1_count(void)
+{
+  return compares*TICK_PERIOD+(uint16_t)(TCNT1-(OCR1A-TICK_PERIOD));
+}
 
 ISR(TIMER1_COMPA_vect)
 {
+  static uint8_t divider=TICK_DIVIDER;
+  static uint8_t tenths;
+  OCR1A+=TICK_PERIOD;
+  compares++;
+  if (--divider) return;
+  divider=TICK_DIVIDER;
+  ticks++;
+  if (++tenths==10) {
+    tenths=0;
+    uptime++;
+  }
+
   buttons_poll();
   if (tprobe_timer>0) tprobe_timer--;
   if (alarm_timer>0) alarm_timer--;
@@ -1,7 +1,18 @@
 #ifndef _timer_h
 #define _timer_h
 
+#include <stdint.h>
+
+/* Timer1 counts at 2MHz */
+#define TIMER1_TICKS_PER_US (F_CPU/8000000UL)
+
 extern void timer_init(void);
+extern uint32_t get_uptime(void);
+/* Tenths of a second since reset; wraps, so only use differences */
+extern uint16_t get_ticks(void);
+/* Timer1 counts since reset; wraps after about 35 minutes, so only use
+   differences.  Call with interrupts off. */
+extern uint32_t timer1_count(void);
 
 extern uint8_t tprobe_timer;
 extern uint8_t alarm_timer;
@@ -8,12 +8,33 @@ class Command(BaseCommand):
     def handle(self,*args,**options):
         now = django.utils.timezone.now()
         for c in Controller.objects.all():
-            # Check all the non-config registers
-            for r in c.register_set.filter(config=False):
+            registers = c.register_set.filter(config=False)
+            # Ask the controller what has changed since last time; if
+            # it can't say, read all the non-config registers in one go
+            changes = c.changes()
+            due = set()
+            if changes and changes[1] is not None:
+                readings = dict(changes[1])
+                # The controller compares longer registers by checksum,
+                # so it can miss a change; read any register that is
+                # due anyway, so that the log catches up
+                due = {r.name for r in registers
+                       if r.name not in readings and r.due()}
+                if due:
+                    readings.update(c.read_many(sorted(due)) or {})
+            else:
+                readings = c.read_many([r.name for r in registers])
+            if changes and readings is not None:
+                c.generation = changes[0]
+                c.save()
+            unchanged = changes is not None and changes[1] is not None
+            readings = readings or {}
+            for r in registers:
                 if r.future_time and r.future_time <= now:
                     r.set(r.future_value)
                     r.future_time = None
                     r.future_value = None
                     r.save()
                 else:
-                    r.value()
+                    r.value(reading=readings.get(r.name),
+                            unchanged=unchanged and r.name not in due)
@@ -0,0 +1,16 @@
+from django.db import migrations, models
+
+
+class Migration(migrations.Migration):
+
+    dependencies = [
+        ('datalog', '0002_auto_20190418_1408'),
+    ]
+
+    operations = [
+        migrations.AddField(
+            model_name='controller',
+            name='generation',
+            field=models.IntegerField(blank=True, editable=False, null=True),
+        ),
+    ]
@@ -18,6 +18,8 @@ class Controller(models.Model):
     address = models.TextField()
     port = models.IntegerField()
     active = models.BooleanField()
+    # Generation of the controller's state we last logged, for CHANGES
+    generation = models.IntegerField(null=True, blank=True, editable=False)
 
     def connect(self):
         """Connect to this controller.
@@ -58,6 +60,76 @@ class Controller(models.Model):
         finally:
             s.close()
 
+    def read_many(self, registers):
+        """Read several registers at once.
+
+        registers is a list of names or patterns like "t*".  Returns a
+        dict of name to string, or None if there is a failure.  The
+        controller's receive buffer only holds 80 characters, so a long
+        list is sent as several READs, all sent before we wait for the
+        replies.
+        """
+        batches = [[]]
+        for r in registers:
+            if len(",".join(batches[-1] + [r])) > 70:
+                batches.append([])
+            batches[-1].append(r)
+        s = self.connect()
+        if not s:
+            return None
+        try:
+            for batch in batches:
+                if len(batch) == 1:
+                    # Make sure we get name=value back
+                    batch = batch * 2
+                s.write("READ %s\n" % ",".join(batch))
+            s.flush()
+            values = {}
+            for batch in batches:
+                response = s.readline().strip()
+                if response[0:3] != "OK ":
+                    return None
+                for item in response[3:].split(";"):
+                    name, eq, value = item.partition("=")
+                    if eq:
+                        values[name] = value
+            return values
+        finally:
+            s.close()
+
+    def changes(self):
+        """Find out which registers have changed since self.generation.
+
+        Returns (generation, dict of name to string), where the dict is
+        None if the controller can't say, perhaps because it has been
+        reset, and everything must be read again; or None if there is a
+        failure.  Save the generation in self.generation once the
+        values have been dealt with.
+        """
+        s = self.connect()
+        if not s:
+            return None
+        try:
+            if self.generation is None:
+                s.write("CHANGES\n")
+            else:
+                s.write("CHANGES %d\n" % self.generation)
+            s.flush()
+            response = s.readline().strip()
+            if response[0:3] != "OK ":
+                return None
+            generation, sp, items = response[3:].partition(" ")
+            if items == "*":
+                return int(generation), None
+            values = {}
+            for item in items.split(";"):
+                name, eq, value = item.partition("=")
+                if eq:
+                    values[name] = value
+            return int(generation), values
+        finally:
+            s.close()
+
     def write(self, register, value):
         """Write a string to a register.
         """
@@ -72,6 +144,88 @@ class Controller(models.Model):
         finally:
             s.close()
 
+    def write_many(self, values):
+        """Write several registers at once.
+
+        values is a list of (register, value) pairs.  They are staged
+        between BEGIN and COMMIT, so the controller applies all of them
+        together or none of them.  Returns the final response.
+        """
+        s = self.connect()
+        if not s:
+            return None # Exception?
+        try:
+            s.write("BEGIN\n")
+            s.flush()
+            response = s.readline().strip()
+            if response != "OK begin":
+                return response
+            for register, value in values:
+                s.write("SET %s %s\n" % (register, value))
+                s.flush()
+                response = s.readline().strip()
+                if response[0:3] != "OK ":
+                    s.write("ABORT\n")
+                    s.flush()
+                    s.readline()
+                    return response
+            s.write("COMMIT\n")
+            s.flush()
+            return s.readline().strip()
+        finally:
+            s.close()
+
+    def dump_config(self):
+        """Fetch the controller's eeprom configuration image.
+
+        Returns (layout version, list of CFGDUMP chunk lines), or None
+        if there is a failure.  The lines can be passed to
+        load_config() for this or another controller.
+        """
+        s = self.connect()
+        if not s:
+            return None
+        try:
+            s.write("CFGDUMP\n")
+            s.flush()
+            response = s.readline().split()
+            if len(response) != 5 or response[0] != "OK":
+                return None
+            layout, count = int(response[2]), int(response[4])
+            for n in range(count):
+                s.write("CFGDUMP %d\n" % n)
+            s.flush()
+            chunks = []
+            for n in range(count):
+                response = s.readline().strip()
+                if response[0:3] != "OK ":
+                    return None
+                chunks.append(response[3:])
+            return layout, chunks
+        finally:
+            s.close()
+
+    def load_config(self, image):
+        """Load an image returned by dump_config().
+
+        The controller keeps its own ident, bus address, flash counter,
+        valve statistics and profile position.  Returns the final response.
+        """
+        layout, chunks = image
+        s = self.connect()
+        if not s:
+            return None
+        try:
+            for line in ["%d" % layout] + chunks + ["END"]:
+                s.write("CFGLOAD %s\n" % line)
+                s.flush()
+                response = s.readline().strip()
+                if response[0:3] != "OK ":
+                    break
+            return response
+        finally:
+            s.close()
+
     def regs(self):
         """Return register set as a dict for use in templates.
 
@@ -175,18 +329,38 @@ class Register(models.Model):
     def __str__(self):
         return "%s %s" % (self.controller, self.name)
 
-    def value(self, force_check=False):
+    def due(self):
+        """Is it time to read this register from the hardware again?"""
+        dt = DATATYPE_DICT[self.datatype]
+        dp = dt.objects.filter(register=self).order_by('-timestamp').first()
+        return dp is None or (now() - dp.timestamp
+                              > datetime.timedelta(seconds=self.max_interval))
+
+    def value(self, force_check=False, reading=None, unchanged=False):
+        # reading is the register's value if it has just been read
+        # from the hardware along with others, or None.  unchanged
+        # means the controller has told us the value is the same as
+        # when we last read it.
         # Read most recent (up to) two datapoints.
         dt = DATATYPE_DICT[self.datatype]
         dpl = dt.objects.filter(register=self).order_by('-timestamp')[:2]
         # If there are zero datapoints, we always record a new one.
         # Otherwise, we check to see how old the most recent datapoint
         # is, and consider recording a new one if it is more than
-        # max_interval seconds old.
+        # max_interval seconds old.  A change the controller has
+        # reported is recorded straight away: it won't be reported
+        # again, so if we waited, unchanged would later have us carry
+        # the old value forward.
         if len(dpl) == 0 or force_check or (
             (now() - dpl[0].timestamp)
-            > datetime.timedelta(seconds=self.max_interval)):
-            r = self.controller.read(self.name)
+            > datetime.timedelta(seconds=self.max_interval)) or (
+            unchanged and reading and
+            dt.cast(reading) != dpl[0].data):
+            r = reading
+            if r is None and unchanged and len(dpl) > 0:
+                r = dpl[0].data
+            if r is None:
+                r = self.controller.read(self.name)
             if not r:
                 # Reading from the hardware failed.  We return the most
                 # recent value if there is one, or None.
@@ -243,6 +417,18 @@ class Register(models.Model):
         self.value(force_check=True)
         return rv
 
+    @staticmethod
+    def set_many(controller, values):
+        """Set new values for several registers of one controller at once
+
+        values is a list of (register, value) pairs.  As for set(),
+        errors are ignored.
+        """
+        rv = controller.write_many([(r.name, v) for r, v in values])
+        for r, v in values:
+            r.value(force_check=True)
+        return rv
+
     class Meta:
         ordering = ['id']
 
@@ -34,6 +34,7 @@ def detail(request, name, config=False):
         fcform = FutureChangeForm(request.POST)
         if fcform.is_valid():
             after = fcform.cleaned_data['after']
+            immediate = []
             for r in registers:
                 if 'set' in request.POST:
                     if r.name in request.POST and request.POST[r.name]:
@@ -42,11 +43,15 @@ def detail(request, name, config=False):
                             r.future_time = after
                             r.save()
                         else:
-                            r.set(request.POST[r.name])
+                            immediate.append((r, request.POST[r.name]))
                 elif 'clear' in request.POST:
                     r.future_value = None
                     r.future_time = None
                     r.save()
+            # Set everything in one transaction, so the controller
+            # never runs with only some of the new values
+            if immediate:
+                Register.set_many(controller, immediate)
             return HttpResponseRedirect(
                 reverse('datalog-controller-config' if config
                         else 'datalog-controller',
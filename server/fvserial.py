@@ -11,8 +11,90 @@
 # returning the RS485 network to the default state if a timeout
 # occurs.
 
+# As well as text commands, a client may send
+#   FRAME hex
+# where hex is the sequence number, command and data of a binary frame
+# (see firmware/frame.h).  We add the framing and CRC, send it, check
+# the reply's CRC and sequence number, retrying if it was corrupt, and
+# respond
+#   FRAME hex
+# with the status and data of the reply, or TIMEOUT or CORRUPT.
+
+# Controllers with a bus address (addr) are selected by a single
+# address character with the ninth bit set, rather than by SELECT
+# ident.  Give ident=addr pairs on the command line after the line rate
+# and we send the address for SELECT of those controllers.  The port
+# runs with space parity, so the parity bit is the ninth bit; we switch
+# to mark parity to send an address.  Either every controller on the
+# bus has an address or none does.
+
+# With addresses, a client may also send
+#   POLLALL slot_ms
+# and we collect the status line each controller sends in its slot,
+# responding
+#   OK line;line;...
+# in address order, with "addr TIMEOUT" for any controller that didn't
+# answer (one that is late getting to the command stays quiet rather
+# than run into the next slot), or TIMEOUT if none answered.
+
+# Clients may send several commands without waiting for the replies;
+# we send them on as fast as the selected controller can queue them,
+# and pass the replies back in order.
+
+import select
 import serial
 import socketserver
+import struct
+import sys
+import time
+
+FRAME_START = 0x01
+FRAME_RETRIES = 2
+FRAME_BAD_CRC = 1 # Reply status: the controller got a corrupt frame
+RX_BUFSIZE = 80 # SERIAL_RX_BUFSIZE in firmware/config.h
+DEFAULT_BAUD = 9600 # Controllers start at this rate
+PIPELINE = 2 # SERIAL_RX_SLOTS in firmware/config.h
+# Commands that change who is listening, or how, so everything sent
+# before them has to be answered first
+UNPIPELINED = (b"SELECT ", b"BAUD ", b"POLLALL ", b"FRAME ")
+BROADCAST = 0 # Bus address that every controller listens to
+
+def crc16(data):
+    """CRC-16/XMODEM, as _crc_xmodem_update() in avr-libc"""
+    crc = 0
+    for b in data:
+        crc ^= b << 8
+        for i in range(8):
+            if crc & 0x8000:
+                crc = ((crc << 1) ^ 0x1021) & 0xffff
+            else:
+                crc = (crc << 1) & 0xffff
+    return crc
+
+def encode_frame(seq, command, data=b""):
+    """Make a frame from a sequence number, command byte and data"""
+    body = bytes([len(data) + 2, seq, command]) + data
+    return bytes([FRAME_START]) + body + struct.pack(">H", crc16(body))
+
+def read_frame(s):
+    """Read a frame from the serial port.
+
+    Returns (sequence number, status, data), or None on timeout or if
+    the frame is corrupt.
+    """
+    start = s.read()
+    if start != bytes([FRAME_START]):
+        return None
+    length = s.read()
+    if len(length) != 1 or length[0] < 2:
+        return None
+    rest = s.read(length[0] + 2)
+    if len(rest) != length[0] + 2:
+        return None
+    body = length + rest[:-2]
+    if struct.unpack(">H", rest[-2:])[0] != crc16(body):
+        return None
+    return body[1], body[2], body[3:]
 
 def full_reset(s):
     """Return the bus to a known state
@@ -20,11 +102,13 @@ def full_reset(s):
     Terminate any previous command with \n, send a SELECT NONE\n, and
     discard everything from the receive buffer.
     """
-    # Terminate any partly-sent command.  We have to wait after
-    # sending this for up to 0.1s for any output from the currently
-    # selected controller to be completed; we receive and discard this
-    # output.  No controller will send more than one line.
-    s.write(b"\n")
+    # Terminate any partly-sent command.  A partly-sent frame takes
+    # newlines as data, so send enough to fill the receive buffer;
+    # controllers ignore empty lines.  We have to wait after sending
+    # this for up to 0.1s for any output from the currently selected
+    # controller to be completed; we receive and discard this output.
+    # No controller will send more than one line.
+    s.write(b"\n" * RX_BUFSIZE)
     old_timeout = s.timeout
     s.timeout = 0.1
     # Read until we time out
@@ -33,22 +117,179 @@ def full_reset(s):
         foo = s.read()
     s.timeout = old_timeout
 
+def frame_command(s, hexdata):
+    """Send a frame given as hex, and return the reply as a response line"""
+    try:
+        body = bytes.fromhex(hexdata.decode())
+    except ValueError:
+        return b"CORRUPT\n"
+    if len(body) < 2:
+        return b"CORRUPT\n"
+    frame = encode_frame(body[0], body[1], body[2:])
+    for attempt in range(FRAME_RETRIES + 1):
+        s.write(frame)
+        reply = read_frame(s)
+        if reply and reply[0] == body[0] and reply[1] != FRAME_BAD_CRC:
+            seq, status, data = reply
+            return b"FRAME " + bytes([status]).hex().encode() + \
+                data.hex().encode() + b"\n"
+        # Make sure nothing is left half-received before trying again
+        full_reset(s)
+    return b"TIMEOUT\n" if reply is None else b"CORRUPT\n"
+
+def send_address(s, address):
+    """Send a bus address character, with the ninth bit set"""
+    s.flush()
+    s.parity = serial.PARITY_MARK
+    s.write(bytes([address]))
+    s.flush()
+    s.parity = serial.PARITY_SPACE
+
+def select_none(s):
+    """Make sure no controller is selected"""
+    if addresses:
+        # Deselects everybody, and leaves them all listening
+        send_address(s, BROADCAST)
+    s.write(b"SELECT NONE\n")
+    s.flush()
+
+def send_command(s, data):
+    """Send a command line, selecting by address if we can"""
+    if data.startswith(b"SELECT ") and data[7:] in addresses:
+        send_address(s, addresses[data[7:]])
+    else:
+        s.write(data + b"\n")
+
+def poll_all(s, data):
+    """Broadcast POLLALL and gather the replies as a response line"""
+    try:
+        slot_ms = int(data[8:])
+    except ValueError:
+        return b"CORRUPT\n"
+    full_reset(s)
+    select_none(s)
+    time.sleep(0.05)
+    s.write(data + b"\n")
+    s.flush()
+    # Wait for the last slot to end, plus time for the controllers to
+    # get round to the command
+    deadline = time.time() + max(addresses.values()) * slot_ms / 1000 + 0.2
+    lines = []
+    old_timeout = s.timeout
+    while True:
+        s.timeout = max(deadline - time.time(), 0)
+        line = s.read_until().replace(b'\0', b'')
+        if not line.endswith(b"\n"):
+            break
+        lines.append(line.strip())
+    s.timeout = old_timeout
+    if not lines:
+        return b"TIMEOUT\n"
+    replies = {}
+    for line in lines:
+        try:
+            replies[int(line.split()[0])] = line
+        except (IndexError, ValueError):
+            pass # Corrupt; treat the station as not having answered
+    return b"OK " + b";".join(
+        replies.get(a, b"%d TIMEOUT" % a)
+        for a in sorted(set(addresses.values()))) + b"\n"
+
+def read_response(s):
+    """Read a reply line from the bus, or make up TIMEOUT or CORRUPT"""
+    response = s.read_until()
+    # A floating line produces \0 characters.  Remove them.
+    response = response.replace(b'\0', b'')
+    if response == b"":
+        return b"TIMEOUT\n"
+    if response[-1] != ord("\n"):
+        return b"CORRUPT\n"
+    return response
+
+def set_bus_baud(s, baud):
+    """Move every controller on the bus, and the port, to a new rate
+
+    BAUD goes to all controllers, selected or not.  A controller moved
+    to a rate other than 9600 goes back to 9600 unless it hears a valid
+    command within a few seconds, so we follow up with a SELECT that
+    nobody answers.  Commands that arrive while a controller is busy
+    with the last one are dropped, hence the pauses.
+    """
+    full_reset(s)
+    select_none(s)
+    time.sleep(0.05)
+    s.write(b"BAUD %d\n" % baud)
+    s.flush()
+    time.sleep(0.05)
+    s.baudrate = baud
+    full_reset(s)
+    select_none(s)
+    time.sleep(0.05)
+
+def negotiate(s, baud):
+    """Bring every controller to the rate we want
+
+    Some may be at 9600 after a reset or fallback, and others at our
+    rate from earlier, so send everybody back to 9600 first.
+    """
+    if s.baudrate != DEFAULT_BAUD:
+        set_bus_baud(s, DEFAULT_BAUD)
+    if baud != DEFAULT_BAUD:
+        set_bus_baud(s, baud)
+
 class ConnectionHandler(socketserver.StreamRequestHandler):
+    # Unbuffered, so that select() shows whether the client has sent
+    # more commands
+    rbufsize = 0
+
+    def more_waiting(self):
+        return select.select([self.connection], [], [], 0)[0] != []
+
+    def unpipelined(self, data):
+        """Deal with a command that has to wait for the bus to be idle"""
+        if data.startswith(b"FRAME "):
+            return frame_command(s, data[6:])
+        if data.startswith(b"POLLALL ") and addresses:
+            return poll_all(s, data)
+        send_command(s, data)
+        response = read_response(s)
+        if (response == b"TIMEOUT\n" and data.startswith(b"SELECT ")
+            and bus_baud != DEFAULT_BAUD):
+            # The controller may have been reset and be back at
+            # 9600; bring it up to our rate and try again
+            negotiate(s, bus_baud)
+            send_command(s, data)
+            response = read_response(s)
+        return response
+
     def handle(self):
-        for data in self.rfile:
-            data = data.strip()
-            s.write(data + b"\n")
-            response = s.read_until()
-            # A floating line produces \0 characters.  Remove them.
-            response = response.replace(b'\0', b'')
-            if response == b"":
-                response = b"TIMEOUT\n"
-            elif response[-1] != ord("\n"):
-                response = b"CORRUPT\n"
-            try:
-                self.wfile.write(response)
-            except:
-                break
+        # Commands sent whose replies we haven't passed on yet.  While
+        # the client has more to send, we keep up to PIPELINE going.
+        pending = 0
+        try:
+            while True:
+                if pending and (pending == PIPELINE
+                                or not self.more_waiting()):
+                    self.wfile.write(read_response(s))
+                    pending -= 1
+                    continue
+                data = self.rfile.readline()
+                if not data:
+                    break
+                data = data.strip()
+                if not data.startswith(UNPIPELINED):
+                    send_command(s, data)
+                    pending += 1
+                    continue
+                while pending:
+                    self.wfile.write(read_response(s))
+                    pending -= 1
+                self.wfile.write(self.unpipelined(data))
+        except OSError:
+            pass
+        # Don't leave replies for the next connection
+        for i in range(pending):
+            read_response(s)
 
 class ReuseTCPServer(socketserver.TCPServer):
     allow_reuse_address = True
@@ -58,7 +299,19 @@ if __name__=="__main__":
 
     server = ReuseTCPServer((HOST, PORT), ConnectionHandler)
 
-    s = serial.Serial("/dev/fvcontrollers", timeout=1.0)
+    # Optional line rate for the bus, eg. 38400
+    bus_baud = int(sys.argv[1]) if len(sys.argv) > 1 else DEFAULT_BAUD
+
+    # Optional ident=addr pairs for controllers with bus addresses
+    addresses = {}
+    for arg in sys.argv[2:]:
+        ident, addr = arg.split("=")
+        addresses[ident.encode()] = int(addr)
+
+    s = serial.Serial("/dev/fvcontrollers", baudrate=bus_baud, timeout=1.0,
+                      parity=serial.PARITY_SPACE if addresses
+                      else serial.PARITY_NONE)
+    negotiate(s, bus_baud)
     full_reset(s)
 
     server.serve_forever()